@@ -0,0 +1,115 @@
+#ifndef __BOUNDEDQUEUE_H
+#define __BOUNDEDQUEUE_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <vector>
+
+/**
+ * @brief Bounded lock-free multi-producer, multi-consumer queue
+ *
+ * This is the array-based queue by Dmitry Vyukov. Each cell has a sequence number that
+ * tells producers and consumers whether the cell is ready for them, so push and pop only
+ * need a single compare-and-swap on the enqueue or dequeue position.
+ *
+ * @tparam T Type of the elements, typically a pointer
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    /**
+     * @brief Construct a queue
+     *
+     * @param capacity Maximum number of elements. Rounded up to a power of 2.
+     */
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while(size < capacity) {
+            size *= 2;
+        }
+        mask = size - 1;
+        cells = std::vector<Cell>(size);
+        for(size_t ii = 0; ii < size; ii++) {
+            cells[ii].sequence.store(ii, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /**
+     * @brief Add an element to the queue
+     *
+     * @return true if added, false if the queue is full
+     */
+    bool push(const T &value) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while(true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else
+            if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Remove an element from the queue
+     *
+     * @return true if an element was removed, false if the queue is empty
+     */
+    bool pop(T &value) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while(true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else
+            if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->data;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+protected:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+
+        Cell() : sequence(0), data() {};
+    };
+
+    std::vector<Cell> cells; //!< Ring buffer
+    size_t mask = 0; //!< Size of cells - 1
+    alignas(64) std::atomic<size_t> enqueuePos{0}; //!< Next position to push to
+    alignas(64) std::atomic<size_t> dequeuePos{0}; //!< Next position to pop from
+};
+
+#endif // __BOUNDEDQUEUE_H
@@ -0,0 +1,268 @@
+#include "FileUploadEncoder.h"
+
+#include "Crc32cRK.h"
+#include "FileUploadReceiver.h"
+#include "Sha1.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+void appendCborHead(std::vector<uint8_t> &cbor, uint8_t major, uint64_t arg) {
+    major <<= 5;
+    if (arg < 24) {
+        cbor.push_back((uint8_t)(major | arg));
+        return;
+    }
+    int numBytes = (arg <= 0xff) ? 1 : (arg <= 0xffff) ? 2 : (arg <= 0xffffffff) ? 4 : 8;
+    cbor.push_back((uint8_t)(major | ((numBytes == 1) ? 24 : (numBytes == 2) ? 25 : (numBytes == 4) ? 26 : 27)));
+    for(int ii = numBytes - 1; ii >= 0; ii--) {
+        cbor.push_back((uint8_t)(arg >> (ii * 8)));
+    }
+}
+
+void skipJsonSpace(const char *&p) {
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+}
+
+bool parseJsonString(const char *&p, std::string &str) {
+    if (*p++ != '"') {
+        return false;
+    }
+    while(*p != '"') {
+        if (!*p) {
+            return false;
+        }
+        if (*p != '\\') {
+            str += *p++;
+            continue;
+        }
+        p++;
+        switch(*p++) {
+        case '"': str += '"'; break;
+        case '\\': str += '\\'; break;
+        case '/': str += '/'; break;
+        case 'b': str += '\b'; break;
+        case 'f': str += '\f'; break;
+        case 'n': str += '\n'; break;
+        case 'r': str += '\r'; break;
+        case 't': str += '\t'; break;
+        case 'u': {
+            char hex[5] = {0};
+            for(int ii = 0; ii < 4; ii++) {
+                if (!isxdigit((unsigned char)*p)) {
+                    return false;
+                }
+                hex[ii] = *p++;
+            }
+            // Encode as UTF-8 (surrogate pairs are not combined)
+            unsigned long c = strtoul(hex, nullptr, 16);
+            if (c < 0x80) {
+                str += (char) c;
+            }
+            else
+            if (c < 0x800) {
+                str += (char)(0xc0 | (c >> 6));
+                str += (char)(0x80 | (c & 0x3f));
+            }
+            else {
+                str += (char)(0xe0 | (c >> 12));
+                str += (char)(0x80 | ((c >> 6) & 0x3f));
+                str += (char)(0x80 | (c & 0x3f));
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    p++;
+    return true;
+}
+
+// Converts one JSON value to CBOR the way encodeToCBOR() on the device encodes a Variant: integers
+// as CBOR integers, other numbers as 64-bit floating point. Returns false if the JSON is invalid.
+bool jsonToCbor(const char *&p, std::vector<uint8_t> &cbor, int depth = 0) {
+    skipJsonSpace(p);
+    if (depth > 32) {
+        return false;
+    }
+
+    if (*p == '{' || *p == '[') {
+        bool isMap = (*p++ == '{');
+        std::vector<uint8_t> items;
+        uint64_t count = 0;
+
+        skipJsonSpace(p);
+        if (*p != (isMap ? '}' : ']')) {
+            while(true) {
+                if (isMap) {
+                    skipJsonSpace(p);
+                    std::string key;
+                    if (!parseJsonString(p, key)) {
+                        return false;
+                    }
+                    appendCborHead(items, 3, key.size());
+                    items.insert(items.end(), key.begin(), key.end());
+
+                    skipJsonSpace(p);
+                    if (*p++ != ':') {
+                        return false;
+                    }
+                }
+                if (!jsonToCbor(p, items, depth + 1)) {
+                    return false;
+                }
+                count++;
+
+                skipJsonSpace(p);
+                if (*p != ',') {
+                    break;
+                }
+                p++;
+            }
+            if (*p != (isMap ? '}' : ']')) {
+                return false;
+            }
+        }
+        p++;
+        appendCborHead(cbor, isMap ? 5 : 4, count);
+        cbor.insert(cbor.end(), items.begin(), items.end());
+        return true;
+    }
+
+    if (*p == '"') {
+        std::string str;
+        if (!parseJsonString(p, str)) {
+            return false;
+        }
+        appendCborHead(cbor, 3, str.size());
+        cbor.insert(cbor.end(), str.begin(), str.end());
+        return true;
+    }
+
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0 || strncmp(p, "null", 4) == 0) {
+        cbor.push_back((*p == 't') ? 0xf5 : (*p == 'f') ? 0xf4 : 0xf6);
+        p += (*p == 'f') ? 5 : 4;
+        return true;
+    }
+
+    const char *start = p;
+    char *endInt, *endDouble;
+    long long intValue = strtoll(start, &endInt, 10);
+    double doubleValue = strtod(start, &endDouble);
+    if (endDouble == start) {
+        return false;
+    }
+    if (endInt == endDouble) {
+        if (intValue >= 0) {
+            appendCborHead(cbor, 0, (uint64_t) intValue);
+        }
+        else {
+            appendCborHead(cbor, 1, (uint64_t)(-(intValue + 1)));
+        }
+    }
+    else {
+        uint64_t bits;
+        memcpy(&bits, &doubleValue, sizeof(bits));
+        cbor.push_back(0xfb);
+        for(int ii = 7; ii >= 0; ii--) {
+            cbor.push_back((uint8_t)(bits >> (ii * 8)));
+        }
+    }
+    p = endDouble;
+    return true;
+}
+
+}
+
+// [static]
+std::vector<std::vector<uint8_t>> FileUploadEncoder::encode(const uint8_t *data, size_t size, uint32_t fileId, size_t maxEventSize, bool chunkCrc, const std::string &metaJson, uint8_t protocolVersion) {
+    typedef FileUploadReceiver::ChunkHeader ChunkHeader;
+
+    std::vector<std::vector<uint8_t>> events;
+
+    auto appendHeader = [](std::vector<uint8_t> &event, const ChunkHeader &ch) {
+        const uint8_t *p = (const uint8_t *)&ch;
+        event.insert(event.end(), p, p + sizeof(ChunkHeader));
+    };
+
+    size_t crcSize = chunkCrc ? sizeof(uint32_t) : 0;
+    size_t maxChunkSize = maxEventSize - sizeof(ChunkHeader) - crcSize;
+    size_t chunkIndex = 0;
+
+    for(size_t chunkOffset = 0; chunkOffset < size; chunkOffset += maxChunkSize) {
+        size_t chunkSize = size - chunkOffset;
+        if (chunkSize > maxChunkSize) {
+            chunkSize = maxChunkSize;
+        }
+
+        ChunkHeader ch;
+        memset(&ch, 0, sizeof(ch));
+        ch.version = protocolVersion;
+        ch.flags = chunkCrc ? FileUploadReceiver::kFlagChunkCrc : 0;
+        ch.chunkIndexHigh = (uint16_t) (chunkIndex >> 16);
+        ch.chunkIndex = (uint16_t) chunkIndex++;
+        ch.chunkSize = (uint16_t) chunkSize;
+        ch.chunkOffset = (uint32_t) chunkOffset;
+        ch.fileId = fileId;
+
+        std::vector<uint8_t> event;
+        event.reserve(maxEventSize);
+        appendHeader(event, ch);
+        event.insert(event.end(), &data[chunkOffset], &data[chunkOffset + chunkSize]);
+        if (chunkCrc) {
+            uint32_t crc = Crc32cRK::calculate(&data[chunkOffset], chunkSize);
+            const uint8_t *p = (const uint8_t *)&crc;
+            event.insert(event.end(), p, p + sizeof(crc));
+        }
+        events.push_back(std::move(event));
+    }
+
+    Sha1 sha1;
+    sha1.update(data, size);
+
+    std::string trailer;
+    if (protocolVersion == 1) {
+        trailer = "{\"s\":" + std::to_string(size) + ",\"h\":\"" + sha1.finalHex() + "\",\"id\":" + std::to_string(fileId) +
+            ",\"n\":" + std::to_string(chunkIndex) + ",\"e\":0,\"m\":" + metaJson + "}";
+    }
+    else {
+        FileUploadReceiver::TrailerV2 trailerV2;
+        memset(&trailerV2, 0, sizeof(trailerV2));
+        trailerV2.fileSize = (uint32_t) size;
+        sha1.final(trailerV2.hash);
+        trailerV2.chunkCount = (uint32_t) chunkIndex;
+        trailer.assign((const char *)&trailerV2, sizeof(trailerV2));
+
+        // Meta data follows as CBOR, like encodeToCBOR() on the device. Nothing is added for null.
+        std::vector<uint8_t> meta;
+        const char *p = metaJson.c_str();
+        if (jsonToCbor(p, meta) && meta.size() && meta[0] != 0xf6) {
+            skipJsonSpace(p);
+            if (!*p) {
+                trailer.append((const char *)meta.data(), meta.size());
+            }
+        }
+    }
+
+    ChunkHeader ch;
+    memset(&ch, 0, sizeof(ch));
+    ch.version = protocolVersion;
+    ch.flags = FileUploadReceiver::kFlagTrailer;
+    ch.chunkSize = (uint16_t) trailer.size();
+    ch.fileId = fileId;
+
+    // Trailer goes at the end of the last event if it fits, otherwise in its own event
+    if (events.empty() || (events.back().size() + sizeof(ChunkHeader) + trailer.size()) > maxEventSize) {
+        events.push_back(std::vector<uint8_t>());
+    }
+    appendHeader(events.back(), ch);
+    events.back().insert(events.back().end(), trailer.begin(), trailer.end());
+
+    return events;
+}
@@ -0,0 +1,33 @@
+#ifndef __FILEUPLOADENCODER_H
+#define __FILEUPLOADENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Host-side encoder that creates events in the same format as FileUploadRK
+ *
+ * This is used for testing receivers and generating load without devices.
+ */
+class FileUploadEncoder {
+public:
+    /**
+     * @brief Split a file into events
+     *
+     * @param data The file data
+     * @param size Size of the file in bytes
+     * @param fileId fileId to put in the chunk headers
+     * @param maxEventSize Maximum event size, same as FileUploadRK::withMaxEventSize()
+     * @param chunkCrc Append a CRC-32C to each chunk, same as FileUploadRK::withChunkCrc()
+     * @param metaJson JSON value for the "m" key in the trailer. For protocol version 2 it's converted to
+     * CBOR after the TrailerV2 structure, the same as the device does; it's omitted if it's null or not valid JSON.
+     * @param protocolVersion 2 for a binary trailer (FileUploadReceiver::TrailerV2, the device default) or 1 for a JSON trailer
+     * @return std::vector<std::vector<uint8_t>> The events, in the order the device would send them
+     */
+    static std::vector<std::vector<uint8_t>> encode(const uint8_t *data, size_t size, uint32_t fileId, size_t maxEventSize = 16384, bool chunkCrc = false, const std::string &metaJson = "{}", uint8_t protocolVersion = 2);
+};
+
+#endif // __FILEUPLOADENCODER_H
@@ -0,0 +1,705 @@
+#include "FileUploadReceiver.h"
+
+#include "Crc32cRK.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+
+namespace {
+
+const uint8_t kMinProtocolVersion = 1; // JSON trailer
+const uint8_t kMaxProtocolVersion = 2; // Binary trailer with CBOR meta data
+const size_t kReadBufferSize = 16384;
+
+// Parses the top-level scalar values of a JSON object (the trailer). Nested objects and arrays
+// (such as the meta data "m") are skipped. Returns false if the JSON is not an object.
+bool parseTopLevelJson(const std::string &json, std::map<std::string, std::string> &values) {
+    size_t ii = 0;
+
+    auto skipSpace = [&]() {
+        while(ii < json.size() && isspace((unsigned char)json[ii])) {
+            ii++;
+        }
+    };
+    auto parseString = [&](std::string &result) {
+        // json[ii] is the opening quote
+        result.clear();
+        for(ii++; ii < json.size(); ii++) {
+            char c = json[ii];
+            if (c == '"') {
+                ii++;
+                return true;
+            }
+            if (c == '\\' && (ii + 1) < json.size()) {
+                c = json[++ii];
+            }
+            result += c;
+        }
+        return false;
+    };
+
+    skipSpace();
+    if (ii >= json.size() || json[ii] != '{') {
+        return false;
+    }
+    ii++;
+
+    while(true) {
+        skipSpace();
+        if (ii >= json.size()) {
+            return false;
+        }
+        if (json[ii] == '}') {
+            return true;
+        }
+        if (json[ii] == ',') {
+            ii++;
+            continue;
+        }
+
+        std::string key;
+        if (json[ii] != '"' || !parseString(key)) {
+            return false;
+        }
+        skipSpace();
+        if (ii >= json.size() || json[ii] != ':') {
+            return false;
+        }
+        ii++;
+        skipSpace();
+        if (ii >= json.size()) {
+            return false;
+        }
+
+        if (json[ii] == '"') {
+            std::string value;
+            if (!parseString(value)) {
+                return false;
+            }
+            values[key] = value;
+        }
+        else
+        if (json[ii] == '{' || json[ii] == '[') {
+            // Skip nested value
+            int depth = 0;
+            std::string ignored;
+            while(ii < json.size()) {
+                char c = json[ii];
+                if (c == '"') {
+                    if (!parseString(ignored)) {
+                        return false;
+                    }
+                    continue;
+                }
+                if (c == '{' || c == '[') {
+                    depth++;
+                }
+                else
+                if (c == '}' || c == ']') {
+                    if (--depth == 0) {
+                        ii++;
+                        break;
+                    }
+                }
+                ii++;
+            }
+        }
+        else {
+            size_t start = ii;
+            while(ii < json.size() && json[ii] != ',' && json[ii] != '}' && !isspace((unsigned char)json[ii])) {
+                ii++;
+            }
+            values[key] = json.substr(start, ii - start);
+        }
+    }
+}
+
+void appendJsonString(std::string &json, const char *str, size_t len) {
+    json += '"';
+    for(size_t ii = 0; ii < len; ii++) {
+        unsigned char c = (unsigned char) str[ii];
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += (char) c;
+        }
+        else
+        if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            json += escape;
+        }
+        else {
+            json += (char) c;
+        }
+    }
+    json += '"';
+}
+
+// Converts one CBOR item (the trailer meta data in protocol version 2, generated by encodeToCBOR() on
+// the device) to JSON. Binary data becomes an array of byte values. Returns false if the CBOR is
+// invalid or uses features encodeToCBOR() does not generate, such as indefinite lengths.
+bool cborToJson(const uint8_t *&p, const uint8_t *end, std::string &json, int depth = 0) {
+    if (p >= end || depth > 32) {
+        return false;
+    }
+    uint8_t major = *p >> 5;
+    uint8_t info = *p & 0x1f;
+    p++;
+
+    uint64_t arg = info;
+    if (info >= 24) {
+        if (info > 27) {
+            return false;
+        }
+        size_t numBytes = (size_t)1 << (info - 24);
+        if ((size_t)(end - p) < numBytes) {
+            return false;
+        }
+        arg = 0;
+        for(size_t ii = 0; ii < numBytes; ii++) {
+            arg = (arg << 8) | *p++;
+        }
+    }
+
+    switch(major) {
+    case 0: // unsigned integer
+        json += std::to_string(arg);
+        return true;
+
+    case 1: // negative integer
+        json += "-" + std::to_string(arg + 1);
+        return true;
+
+    case 2: // byte string
+    case 3: // text string
+        if ((uint64_t)(end - p) < arg) {
+            return false;
+        }
+        if (major == 3) {
+            appendJsonString(json, (const char *)p, (size_t)arg);
+        }
+        else {
+            json += '[';
+            for(uint64_t ii = 0; ii < arg; ii++) {
+                json += (ii ? "," : "") + std::to_string(p[ii]);
+            }
+            json += ']';
+        }
+        p += arg;
+        return true;
+
+    case 4: // array
+        json += '[';
+        for(uint64_t ii = 0; ii < arg; ii++) {
+            if (ii) {
+                json += ',';
+            }
+            if (!cborToJson(p, end, json, depth + 1)) {
+                return false;
+            }
+        }
+        json += ']';
+        return true;
+
+    case 5: // map
+        json += '{';
+        for(uint64_t ii = 0; ii < arg; ii++) {
+            if (ii) {
+                json += ',';
+            }
+            std::string key;
+            if (!cborToJson(p, end, key, depth + 1)) {
+                return false;
+            }
+            if (key.empty() || key[0] != '"') {
+                // JSON keys must be strings
+                appendJsonString(json, key.c_str(), key.size());
+            }
+            else {
+                json += key;
+            }
+            json += ':';
+            if (!cborToJson(p, end, json, depth + 1)) {
+                return false;
+            }
+        }
+        json += '}';
+        return true;
+
+    case 6: // tag, ignored
+        return cborToJson(p, end, json, depth + 1);
+
+    default: // simple values and floating point
+        if (info == 20 || info == 21) {
+            json += (info == 21) ? "true" : "false";
+            return true;
+        }
+        if (info == 22 || info == 23) {
+            json += "null";
+            return true;
+        }
+        if (info >= 25 && info <= 27) {
+            double value;
+            if (info == 25) {
+                int exp = (arg >> 10) & 0x1f;
+                int mant = arg & 0x3ff;
+                value = (exp == 0) ? ldexp(mant, -24) : (exp == 31) ? (mant ? NAN : INFINITY) : ldexp(mant + 1024, exp - 25);
+                if (arg & 0x8000) {
+                    value = -value;
+                }
+            }
+            else
+            if (info == 26) {
+                uint32_t bits = (uint32_t) arg;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                value = f;
+            }
+            else {
+                memcpy(&value, &arg, sizeof(value));
+            }
+
+            if (!std::isfinite(value)) {
+                json += "null";
+            }
+            else {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "%.17g", value);
+                json += buf;
+            }
+            return true;
+        }
+        return false;
+    }
+}
+
+bool writeAll(int fd, const void *data, size_t len, off_t offset) {
+    const uint8_t *p = (const uint8_t *) data;
+    while(len > 0) {
+        ssize_t count = pwrite(fd, p, len, offset);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += count;
+        len -= (size_t) count;
+        offset += count;
+    }
+    return true;
+}
+
+}
+
+
+FileUploadReceiver::FileUploadReceiver() {
+}
+
+FileUploadReceiver::~FileUploadReceiver() {
+    while(!transfers.empty()) {
+        removeTransfer(transfers.begin()->second, true);
+    }
+}
+
+int FileUploadReceiver::processEvent(const std::string &deviceId, const uint8_t *data, size_t len, time_t now) {
+    stats.events++;
+
+    if (!isValidDeviceId(deviceId)) {
+        stats.badData++;
+        return kErrorBadData;
+    }
+
+    size_t chunkHeaderOffset = 0;
+    while(chunkHeaderOffset < len) {
+        if ((len - chunkHeaderOffset) < sizeof(ChunkHeader)) {
+            stats.badData++;
+            return kErrorBadData;
+        }
+
+        ChunkHeader ch;
+        memcpy(&ch, &data[chunkHeaderOffset], sizeof(ChunkHeader));
+
+        size_t crcSize = (ch.flags & kFlagChunkCrc) ? sizeof(uint32_t) : 0;
+        size_t dataOffset = chunkHeaderOffset + sizeof(ChunkHeader);
+        if (ch.version < kMinProtocolVersion || ch.version > kMaxProtocolVersion || (dataOffset + ch.chunkSize + crcSize) > len) {
+            stats.badData++;
+            return kErrorBadData;
+        }
+        chunkHeaderOffset = dataOffset + ch.chunkSize + crcSize;
+
+        if (crcSize) {
+            uint32_t expectedCrc;
+            memcpy(&expectedCrc, &data[dataOffset + ch.chunkSize], sizeof(expectedCrc));
+            if (Crc32cRK::calculate(&data[dataOffset], ch.chunkSize) != expectedCrc) {
+                // Discard only this chunk
+                stats.badCrc++;
+                continue;
+            }
+        }
+
+        if ((ch.flags & kFlagProbe) != 0) {
+            int result = handleProbe(deviceId, ch, &data[dataOffset]);
+            if (result != kErrorNone) {
+                return result;
+            }
+            continue;
+        }
+
+        if (completed.count(transferKey(deviceId, ch.fileId))) {
+            // Late duplicate of a file that has already been completed
+            stats.duplicates++;
+            continue;
+        }
+
+        Transfer *transfer = getTransfer(deviceId, ch.fileId, now);
+        if (!transfer) {
+            return kErrorFile;
+        }
+
+        int result;
+        if (ch.flags & kFlagTrailer) {
+            result = storeTrailer(transfer, ch, &data[dataOffset]);
+        }
+        else {
+            result = storeChunk(transfer, ch, &data[dataOffset]);
+        }
+        if (result != kErrorNone) {
+            return result;
+        }
+
+        checkComplete(transfer);
+    }
+
+    return kErrorNone;
+}
+
+size_t FileUploadReceiver::expire(time_t now) {
+    std::vector<Transfer *> expiredTransfers;
+
+    for(auto it = transfers.begin(); it != transfers.end(); it++) {
+        if (it->second->lastActivity + (time_t)expireSeconds < now) {
+            expiredTransfers.push_back(it->second);
+        }
+    }
+
+    for(Transfer *transfer : expiredTransfers) {
+        removeTransfer(transfer, true);
+        stats.expired++;
+    }
+
+    for(auto it = completed.begin(); it != completed.end(); ) {
+        if (it->second + (time_t)expireSeconds < now) {
+            it = completed.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+    return expiredTransfers.size();
+}
+
+size_t FileUploadReceiver::memoryUsage() const {
+    // Approximate size of a std::map node (red-black tree pointers and color) plus the value
+    const size_t mapNodeSize = 4 * sizeof(void *) + sizeof(std::pair<const uint64_t, uint64_t>);
+
+    size_t result = 0;
+    for(auto it = transfers.begin(); it != transfers.end(); it++) {
+        const Transfer *transfer = it->second;
+        result += sizeof(Transfer) + it->first.capacity() + transfer->deviceId.capacity() + transfer->tempPath.capacity() +
+            transfer->chunkBitmap.capacity() * sizeof(uint64_t) + transfer->pendingRanges.size() * mapNodeSize +
+            transfer->trailerHash.capacity() + transfer->trailerJson.capacity();
+    }
+    return result;
+}
+
+bool FileUploadReceiver::isStored(const std::string &deviceId, const std::string &hash) const {
+    auto it = hashes.find(deviceId);
+    if (it == hashes.end()) {
+        return false;
+    }
+    return std::find(it->second.begin(), it->second.end(), hash) != it->second.end();
+}
+
+// [static]
+bool FileUploadReceiver::isValidDeviceId(const std::string &deviceId) {
+    if (deviceId.size() != 24) {
+        return false;
+    }
+    for(char c : deviceId) {
+        if (!isxdigit((unsigned char)c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+FileUploadReceiver::Transfer *FileUploadReceiver::getTransfer(const std::string &deviceId, uint32_t fileId, time_t now) {
+    std::string key = transferKey(deviceId, fileId);
+
+    auto it = transfers.find(key);
+    if (it != transfers.end()) {
+        it->second->lastActivity = now;
+        return it->second;
+    }
+
+    Transfer *transfer = new Transfer();
+    transfer->deviceId = deviceId;
+    transfer->fileId = fileId;
+    transfer->tempPath = outputDir + "/" + deviceId + "-" + std::to_string(fileId) + ".part";
+    transfer->lastActivity = now;
+
+    transfer->fd = open(transfer->tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (transfer->fd == -1) {
+        delete transfer;
+        return nullptr;
+    }
+
+    transfers[key] = transfer;
+    return transfer;
+}
+
+void FileUploadReceiver::removeTransfer(Transfer *transfer, bool deleteTempFile) {
+    if (transfer->fd != -1) {
+        close(transfer->fd);
+        transfer->fd = -1;
+    }
+    if (deleteTempFile) {
+        unlink(transfer->tempPath.c_str());
+    }
+    transfers.erase(transferKey(transfer->deviceId, transfer->fileId));
+    delete transfer;
+}
+
+int FileUploadReceiver::storeChunk(Transfer *transfer, const ChunkHeader &ch, const uint8_t *data) {
+    uint32_t chunkIndex = ((uint32_t)ch.chunkIndexHigh << 16) | ch.chunkIndex;
+
+    // The index is not trusted; it sizes chunkBitmap. Every chunk but the last is full size, so
+    // chunkIndex == chunkOffset / chunkSize, and for the last (shorter) chunk it can only be less.
+    uint64_t maxSize = maxFileSize;
+    uint64_t maxChunks = maxFileSize / kMinChunkSize + 1;
+    if (transfer->haveTrailer) {
+        maxSize = std::min(maxSize, transfer->trailerSize);
+        maxChunks = std::min(maxChunks, (uint64_t)transfer->trailerChunks);
+    }
+    if (ch.chunkSize == 0 || (uint64_t)ch.chunkOffset + ch.chunkSize > maxSize ||
+        (uint64_t)chunkIndex * ch.chunkSize > ch.chunkOffset || chunkIndex >= maxChunks) {
+        stats.badData++;
+        return kErrorNone;
+    }
+
+    size_t word = chunkIndex / 64;
+    uint64_t bit = (uint64_t)1 << (chunkIndex % 64);
+
+    if (word >= transfer->chunkBitmap.size()) {
+        transfer->chunkBitmap.resize(word + 1);
+    }
+    if (transfer->chunkBitmap[word] & bit) {
+        stats.duplicates++;
+        return kErrorNone;
+    }
+
+    if (!writeAll(transfer->fd, data, ch.chunkSize, (off_t)ch.chunkOffset)) {
+        return kErrorFile;
+    }
+    transfer->chunkBitmap[word] |= bit;
+    transfer->chunkCount++;
+    stats.chunks++;
+
+    uint64_t start = ch.chunkOffset;
+    uint64_t end = start + ch.chunkSize;
+
+    if (start == transfer->hashedOffset) {
+        // In order, hash directly from the event data
+        transfer->sha1.update(data, ch.chunkSize);
+        if (rangeHandler) {
+            rangeHandler(transfer->deviceId, transfer->fileId, start, data, ch.chunkSize);
+        }
+        transfer->hashedOffset = end;
+        return hashContiguous(transfer);
+    }
+
+    if (start > transfer->hashedOffset) {
+        // Out of order, remember the range and hash it later from the temporary file
+        auto it = transfer->pendingRanges.upper_bound(start);
+        if (it != transfer->pendingRanges.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= start) {
+                start = prev->first;
+                end = std::max(end, prev->second);
+                it = transfer->pendingRanges.erase(prev);
+            }
+        }
+        while(it != transfer->pendingRanges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = transfer->pendingRanges.erase(it);
+        }
+        transfer->pendingRanges[start] = end;
+    }
+    return kErrorNone;
+}
+
+int FileUploadReceiver::handleProbe(const std::string &deviceId, const ChunkHeader &ch, const uint8_t *data) {
+    std::string json;
+    std::map<std::string, std::string> values;
+
+    if (!trailerToJson(ch, data, json) || !parseTopLevelJson(json, values) || !values.count("h")) {
+        stats.badData++;
+        return kErrorBadData;
+    }
+
+    bool stored = isStored(deviceId, values["h"]);
+    if (stored) {
+        stats.deduped++;
+    }
+    if (probeHandler) {
+        probeHandler(deviceId, ch.fileId, values["h"], stored);
+    }
+    return kErrorNone;
+}
+
+int FileUploadReceiver::storeTrailer(Transfer *transfer, const ChunkHeader &ch, const uint8_t *data) {
+    std::string json;
+    std::map<std::string, std::string> values;
+
+    if (!trailerToJson(ch, data, json) || !parseTopLevelJson(json, values) || !values.count("s") || !values.count("h") || !values.count("n")) {
+        stats.badData++;
+        return kErrorBadData;
+    }
+
+    transfer->haveTrailer = true;
+    transfer->trailerSize = strtoull(values["s"].c_str(), nullptr, 10);
+    transfer->trailerChunks = (size_t) strtoul(values["n"].c_str(), nullptr, 10);
+    transfer->trailerHash = values["h"];
+    transfer->trailerJson = json;
+
+    return kErrorNone;
+}
+
+// [static]
+bool FileUploadReceiver::trailerToJson(const ChunkHeader &ch, const uint8_t *data, std::string &json) {
+    if (ch.version == 1) {
+        json.assign((const char *)data, ch.chunkSize);
+        return true;
+    }
+
+    TrailerV2 trailer;
+    if (ch.chunkSize < sizeof(TrailerV2)) {
+        return false;
+    }
+    memcpy(&trailer, data, sizeof(TrailerV2));
+
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string hash;
+    for(size_t ii = 0; ii < sizeof(trailer.hash); ii++) {
+        hash += hexDigits[trailer.hash[ii] >> 4];
+        hash += hexDigits[trailer.hash[ii] & 0xf];
+    }
+
+    json = "{\"s\":" + std::to_string(trailer.fileSize) + ",\"h\":\"" + hash + "\",\"id\":" + std::to_string(ch.fileId) +
+        ",\"n\":" + std::to_string(trailer.chunkCount) + ",\"e\":" + std::to_string(trailer.elapsedMs) + ",\"m\":";
+
+    if (ch.chunkSize > sizeof(TrailerV2)) {
+        const uint8_t *p = &data[sizeof(TrailerV2)];
+        if (!cborToJson(p, &data[ch.chunkSize], json)) {
+            return false;
+        }
+    }
+    else {
+        json += "{}";
+    }
+    json += "}";
+    return true;
+}
+
+int FileUploadReceiver::hashContiguous(Transfer *transfer) {
+    while(!transfer->pendingRanges.empty()) {
+        auto it = transfer->pendingRanges.begin();
+        if (it->first > transfer->hashedOffset) {
+            break;
+        }
+
+        if (readBuffer.empty()) {
+            readBuffer.resize(kReadBufferSize);
+        }
+
+        for(uint64_t offset = transfer->hashedOffset; offset < it->second; ) {
+            size_t count = (size_t) std::min((uint64_t)readBuffer.size(), it->second - offset);
+            ssize_t result = pread(transfer->fd, readBuffer.data(), count, (off_t)offset);
+            if (result <= 0) {
+                return kErrorFile;
+            }
+            transfer->sha1.update(readBuffer.data(), (size_t)result);
+            if (rangeHandler) {
+                rangeHandler(transfer->deviceId, transfer->fileId, offset, readBuffer.data(), (size_t)result);
+            }
+            offset += (uint64_t)result;
+        }
+        transfer->hashedOffset = std::max(transfer->hashedOffset, it->second);
+        transfer->pendingRanges.erase(it);
+    }
+    return kErrorNone;
+}
+
+void FileUploadReceiver::checkComplete(Transfer *transfer) {
+    if (!transfer->haveTrailer || transfer->chunkCount != transfer->trailerChunks || transfer->hashedOffset != transfer->trailerSize) {
+        return;
+    }
+
+    CompletedFile completedFile;
+    completedFile.deviceId = transfer->deviceId;
+    completedFile.fileId = transfer->fileId;
+    completedFile.size = transfer->trailerSize;
+    completedFile.hash = transfer->sha1.finalHex();
+    completedFile.trailer = transfer->trailerJson;
+
+    if (completedFile.hash != transfer->trailerHash) {
+        stats.badHash++;
+        removeTransfer(transfer, true);
+        return;
+    }
+
+    std::string basePath = outputDir + "/" + transfer->deviceId + "-" + std::to_string(transfer->fileId);
+    completedFile.path = basePath + ".bin";
+
+    close(transfer->fd);
+    transfer->fd = -1;
+    if (rename(transfer->tempPath.c_str(), completedFile.path.c_str()) != 0) {
+        removeTransfer(transfer, true);
+        return;
+    }
+
+    FILE *fp = fopen((basePath + ".json").c_str(), "w");
+    if (fp) {
+        fwrite(transfer->trailerJson.data(), 1, transfer->trailerJson.size(), fp);
+        fclose(fp);
+    }
+
+    completed[transferKey(transfer->deviceId, transfer->fileId)] = transfer->lastActivity;
+
+    std::deque<std::string> &deviceHashes = hashes[transfer->deviceId];
+    if (std::find(deviceHashes.begin(), deviceHashes.end(), completedFile.hash) == deviceHashes.end()) {
+        deviceHashes.push_back(completedFile.hash);
+        if (deviceHashes.size() > kMaxHashes) {
+            deviceHashes.pop_front();
+        }
+    }
+    removeTransfer(transfer, false);
+    stats.success++;
+
+    if (completionHandler) {
+        completionHandler(completedFile);
+    }
+}
+
+// [static]
+std::string FileUploadReceiver::transferKey(const std::string &deviceId, uint32_t fileId) {
+    return deviceId + "/" + std::to_string(fileId);
+}
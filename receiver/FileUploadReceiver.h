@@ -0,0 +1,285 @@
+#ifndef __FILEUPLOADRECEIVER_H
+#define __FILEUPLOADRECEIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Sha1.h"
+
+/**
+ * @brief Host-side receiver for events sent by FileUploadRK
+ *
+ * This does the same thing as scripts/file-upload.js, except it runs on your own server,
+ * for example behind a webhook. Each chunk is written directly to its offset in a temporary
+ * file, and the SHA-1 hash is calculated incrementally as the data becomes contiguous, so
+ * the file is never stored in RAM. When all chunks and the trailer have been received and
+ * the hash matches, the temporary file is renamed and the completion handler is called.
+ *
+ * This class is not thread safe. If you need to use it from multiple threads, either lock
+ * around it or use one instance per thread with each device assigned to one instance.
+ */
+class FileUploadReceiver {
+public:
+    /**
+     * @brief Structure that precedes data in an event. Must match FileUploadRK::ChunkHeader.
+     */
+    struct ChunkHeader { // 16 bytes
+        uint8_t version; //!< Version number (1 = JSON trailer, 2 = binary trailer)
+        uint8_t flags; //!< Various flags (kFlagTrailer, kFlagChunkCrc)
+        uint16_t chunkIndexHigh; //!< Upper 16 bits of the chunk index (0 unless the file has more than 65535 chunks)
+        uint16_t chunkIndex; //!< 0-based index for which chunk this is (lower 16 bits)
+        uint16_t chunkSize; //!< size of this chunk in bytes
+        uint32_t chunkOffset; //!< offset in the file
+        uint32_t fileId; //!< fileId of this chunk
+    };
+
+    /**
+     * @brief Trailer for protocol version 2, followed by CBOR meta data if any. Must match FileUploadRK::TrailerV2.
+     */
+    struct TrailerV2 { // 32 bytes
+        uint32_t fileSize; //!< Size of the file in bytes
+        uint8_t hash[20]; //!< SHA-1 hash of the file (binary, not hex)
+        uint32_t chunkCount; //!< Number of chunks (0 for a dedupe probe)
+        uint32_t elapsedMs; //!< Milliseconds from starting the file until the trailer was generated
+    };
+
+    static const uint8_t kFlagTrailer = 0x01; //!< Chunk is the trailer, not actually a chunk
+    static const uint8_t kFlagChunkCrc = 0x02; //!< Chunk data is followed by a 4-byte CRC-32C of the chunk data
+    static const uint8_t kFlagProbe = 0x04; //!< Trailer is a dedupe probe, sent before any chunks (used with kFlagTrailer)
+
+    static const size_t kMaxHashes = 32; //!< Number of hashes of completed files remembered per device for dedupe probes
+
+    static const size_t kMinChunkSize = 1024 - sizeof(ChunkHeader) - sizeof(uint32_t); //!< Smallest full chunk (1024 byte events with CRC), used to limit the chunk index
+
+    /**
+     * @brief Information about a completed file, passed to the completion handler
+     */
+    struct CompletedFile {
+        std::string deviceId; //!< Device ID that uploaded the file
+        uint32_t fileId = 0; //!< fileId from the chunk headers
+        std::string path; //!< Path to the file in the output directory
+        uint64_t size = 0; //!< Size of the file in bytes
+        std::string hash; //!< SHA-1 hash of the file (hex)
+        std::string trailer; //!< Trailer JSON, including the meta data ("m"). Version 2 trailers are converted to the same JSON.
+    };
+
+    /**
+     * @brief Counters, similar to the stats in the logic block temporary ledger
+     */
+    struct Stats {
+        uint64_t events = 0; //!< Number of events processed
+        uint64_t chunks = 0; //!< Number of chunks stored
+        uint64_t duplicates = 0; //!< Number of chunks ignored because they were already received
+        uint64_t success = 0; //!< Number of files completed with a valid hash
+        uint64_t badHash = 0; //!< Number of files discarded because of a hash mismatch
+        uint64_t badCrc = 0; //!< Number of chunks discarded because of a CRC-32C mismatch
+        uint64_t badData = 0; //!< Number of events or chunks that could not be parsed
+        uint64_t expired = 0; //!< Number of transfers discarded because they were not completed in time
+        uint64_t deduped = 0; //!< Number of probes for files that were already received
+    };
+
+    static const int kErrorNone = 0; //!< Success
+    static const int kErrorBadData = -1; //!< Event could not be parsed
+    static const int kErrorFile = -2; //!< File system error writing the output
+
+    FileUploadReceiver();
+    virtual ~FileUploadReceiver();
+
+    /**
+     * This class cannot be copied because it holds open file descriptors
+     */
+    FileUploadReceiver(const FileUploadReceiver&) = delete;
+
+    /**
+     * This class cannot be copied because it holds open file descriptors
+     */
+    FileUploadReceiver& operator=(const FileUploadReceiver&) = delete;
+
+    /**
+     * @brief Directory to store completed and temporary files in (default: current directory)
+     *
+     * Completed files are stored as deviceId-fileId.bin with the trailer in deviceId-fileId.json.
+     * Temporary files have a .part extension.
+     */
+    FileUploadReceiver &withOutputDir(const char *outputDir) { this->outputDir = outputDir; return *this; };
+
+    /**
+     * @brief How long a transfer can be idle before it's discarded by expire() (default: 300 seconds)
+     */
+    FileUploadReceiver &withExpireSeconds(unsigned int expireSeconds) { this->expireSeconds = expireSeconds; return *this; };
+
+    /**
+     * @brief Largest file that will be accepted (default: 1 Gbyte)
+     *
+     * Chunks past this offset are discarded (badData). This also limits the chunk index, and therefore
+     * the size of the chunk bitmap, to maxFileSize / kMinChunkSize.
+     */
+    FileUploadReceiver &withMaxFileSize(uint64_t maxFileSize) { this->maxFileSize = maxFileSize; return *this; };
+
+    /**
+     * @brief Set the function to call when a file has been received and verified
+     */
+    FileUploadReceiver &withCompletionHandler(std::function<void(const CompletedFile &completedFile)> fn) { this->completionHandler = fn; return *this; };
+
+    /**
+     * @brief Set a function to call with each range of data as it becomes contiguous
+     *
+     * The ranges are passed in order, from offset 0 to the end of the file, so they can be streamed
+     * to another sink (such as a webhook or object storage) without waiting for the whole file.
+     * Each chunk has been verified by its CRC-32C if the device used withChunkCrc(), but the file
+     * hash is only known to be valid when the completion handler is called.
+     */
+    FileUploadReceiver &withRangeHandler(std::function<void(const std::string &deviceId, uint32_t fileId, uint64_t offset, const uint8_t *data, size_t len)> fn) { this->rangeHandler = fn; return *this; };
+
+    /**
+     * @brief Set the function to call when a device sends a dedupe probe
+     *
+     * The device (using FileUploadRK::withDedupe()) is waiting for an event named eventName + "Probe/" + deviceId
+     * with JSON data {"id":fileId,"stored":stored}. Publish that using the Particle Cloud API from the handler.
+     * If this is not set, probes are ignored and the device sends the file after the probe timeout.
+     */
+    FileUploadReceiver &withProbeHandler(std::function<void(const std::string &deviceId, uint32_t fileId, const std::string &hash, bool stored)> fn) { this->probeHandler = fn; return *this; };
+
+    /**
+     * @brief Returns true if a file with this SHA-1 hash (hex) was recently received from this device
+     */
+    bool isStored(const std::string &deviceId, const std::string &hash) const;
+
+    /**
+     * @brief Returns true if deviceId is a Particle device ID (24 hex characters)
+     *
+     * The device ID is used in file names in the output directory, so anything else is rejected.
+     */
+    static bool isValidDeviceId(const std::string &deviceId);
+
+    /**
+     * @brief Process the binary data from one event
+     *
+     * @param deviceId Device ID that published the event. Events with an invalid device ID are discarded (kErrorBadData).
+     * @param data Event data (binary, already decoded)
+     * @param len Length of the event data in bytes
+     * @param now Current time, used for expiration
+     * @return int kErrorNone or a negative error code. Chunks before an error are still processed.
+     */
+    int processEvent(const std::string &deviceId, const uint8_t *data, size_t len, time_t now = time(0));
+
+    /**
+     * @brief Discard transfers that have been idle longer than the expire time
+     *
+     * @param now Current time
+     * @return size_t Number of transfers discarded
+     */
+    size_t expire(time_t now = time(0));
+
+    /**
+     * @brief Number of transfers that have been started but not completed
+     */
+    size_t inFlightCount() const { return transfers.size(); };
+
+    /**
+     * @brief Approximate number of bytes of RAM used by the transfers in progress
+     *
+     * This includes the per-transfer state, bitmap, and pending ranges, but not the file data,
+     * which is stored in the temporary files.
+     */
+    size_t memoryUsage() const;
+
+    /**
+     * @brief Get the counters
+     */
+    const Stats &getStats() const { return stats; };
+
+protected:
+    /**
+     * @brief State for one file being received
+     */
+    struct Transfer {
+        std::string deviceId; //!< Device ID that is sending the file
+        uint32_t fileId = 0; //!< fileId from the chunk headers
+        std::string tempPath; //!< Path to the temporary (sparse) file
+        int fd = -1; //!< File descriptor for tempPath
+        time_t lastActivity = 0; //!< Time the last chunk was received
+
+        std::vector<uint64_t> chunkBitmap; //!< One bit per chunkIndex that has been received
+        size_t chunkCount = 0; //!< Number of bits set in chunkBitmap
+
+        Sha1 sha1; //!< Hash of the bytes from 0 to hashedOffset
+        uint64_t hashedOffset = 0; //!< Bytes before this offset have been hashed
+        std::map<uint64_t, uint64_t> pendingRanges; //!< Received byte ranges after hashedOffset (start -> end), merged
+
+        bool haveTrailer = false; //!< Trailer has been received
+        uint64_t trailerSize = 0; //!< File size from the trailer ("s")
+        size_t trailerChunks = 0; //!< Number of chunks from the trailer ("n")
+        std::string trailerHash; //!< SHA-1 hash from the trailer ("h")
+        std::string trailerJson; //!< Trailer JSON
+    };
+
+    /**
+     * @brief Find or create the transfer for a device and fileId
+     */
+    Transfer *getTransfer(const std::string &deviceId, uint32_t fileId, time_t now);
+
+    /**
+     * @brief Close and remove a transfer, optionally deleting the temporary file
+     */
+    void removeTransfer(Transfer *transfer, bool deleteTempFile);
+
+    /**
+     * @brief Store one chunk of data
+     */
+    int storeChunk(Transfer *transfer, const ChunkHeader &ch, const uint8_t *data);
+
+    /**
+     * @brief Respond to a dedupe probe
+     */
+    int handleProbe(const std::string &deviceId, const ChunkHeader &ch, const uint8_t *data);
+
+    /**
+     * @brief Store the trailer
+     */
+    int storeTrailer(Transfer *transfer, const ChunkHeader &ch, const uint8_t *data);
+
+    /**
+     * @brief Get the trailer as JSON, converting it from binary for protocol version 2
+     *
+     * @return true if the trailer is valid
+     */
+    static bool trailerToJson(const ChunkHeader &ch, const uint8_t *data, std::string &json);
+
+    /**
+     * @brief Hash any pending ranges that are now contiguous with hashedOffset
+     */
+    int hashContiguous(Transfer *transfer);
+
+    /**
+     * @brief Check if a transfer is complete, and if so verify and finish it
+     */
+    void checkComplete(Transfer *transfer);
+
+    /**
+     * @brief Key for the transfers map
+     */
+    static std::string transferKey(const std::string &deviceId, uint32_t fileId);
+
+    std::string outputDir = "."; //!< Directory for completed and temporary files
+    unsigned int expireSeconds = 300; //!< Idle transfers are discarded after this many seconds
+    uint64_t maxFileSize = 1024 * 1024 * 1024; //!< Largest file accepted (set using withMaxFileSize())
+    std::function<void(const CompletedFile &completedFile)> completionHandler = 0; //!< Function to call when a file has been received
+    std::function<void(const std::string &deviceId, uint32_t fileId, uint64_t offset, const uint8_t *data, size_t len)> rangeHandler = 0; //!< Function to call with contiguous data
+    std::unordered_map<std::string, Transfer *> transfers; //!< Transfers in progress
+    std::function<void(const std::string &deviceId, uint32_t fileId, const std::string &hash, bool stored)> probeHandler = 0; //!< Function to call for dedupe probes
+    std::unordered_map<std::string, time_t> completed; //!< Recently completed transfers, so late duplicate chunks are ignored
+    std::unordered_map<std::string, std::deque<std::string>> hashes; //!< Hashes of the last kMaxHashes files completed for each device
+    std::vector<uint8_t> readBuffer; //!< Buffer used when hashing data read back from temporary files
+    Stats stats; //!< Counters
+};
+
+#endif // __FILEUPLOADRECEIVER_H
@@ -0,0 +1,179 @@
+#include "FileUploadReceiverEngine.h"
+
+#include <string.h>
+
+FileUploadReceiverEngine::FileUploadReceiverEngine() {
+    numThreads = std::thread::hardware_concurrency();
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+}
+
+FileUploadReceiverEngine::~FileUploadReceiverEngine() {
+    stop();
+}
+
+void FileUploadReceiverEngine::start() {
+    // Discard the shards from a previous run, including any partial transfers
+    stop();
+    shards.clear();
+
+    stopping = false;
+
+    for(size_t ii = 0; ii < numThreads; ii++) {
+        Shard *shard = new Shard(queueSize);
+        shard->receiver
+            .withOutputDir(outputDir.c_str())
+            .withExpireSeconds(expireSeconds)
+            .withProbeHandler(probeHandler);
+
+        shard->receiver.withCompletionHandler([this, shard](const FileUploadReceiver::CompletedFile &completedFile) {
+            std::chrono::microseconds latency(0);
+
+            auto it = shard->startTimes.find(completedFile.deviceId + "/" + std::to_string(completedFile.fileId));
+            if (it != shard->startTimes.end()) {
+                latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - it->second);
+                shard->startTimes.erase(it);
+            }
+            if (completionHandler) {
+                completionHandler(completedFile, latency);
+            }
+        });
+
+        shards.push_back(std::unique_ptr<Shard>(shard));
+    }
+
+    // Start the threads after all shards exist so submit() never sees a partial vector
+    for(auto &shard : shards) {
+        shard->thread = std::thread(&FileUploadReceiverEngine::workerThread, this, shard.get());
+    }
+}
+
+void FileUploadReceiverEngine::stop() {
+    stopping = true;
+    for(auto &shard : shards) {
+        if (shard->thread.joinable()) {
+            shard->thread.join();
+        }
+
+        // The worker drains its queue before exiting, so this only frees events that were pushed after that
+        QueuedEvent *event;
+        while(shard->queue.pop(event)) {
+            delete event;
+        }
+    }
+}
+
+bool FileUploadReceiverEngine::submit(const std::string &deviceId, const uint8_t *data, size_t len) {
+    if (stopping || shards.empty()) {
+        // Not started, or stopped; no worker would process the event
+        return false;
+    }
+
+    QueuedEvent *event = new QueuedEvent();
+    event->deviceId = deviceId;
+    event->data.assign(data, data + len);
+    event->submitted = std::chrono::steady_clock::now();
+
+    Shard *shard = shards[std::hash<std::string>()(deviceId) % shards.size()].get();
+    while(!shard->queue.push(event)) {
+        // Worker is behind; wait for it to catch up
+        if (stopping) {
+            delete event;
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+size_t FileUploadReceiverEngine::inFlightCount() const {
+    size_t result = 0;
+    for(auto &shard : shards) {
+        result += shard->inFlight.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+size_t FileUploadReceiverEngine::memoryUsage() const {
+    size_t result = 0;
+    for(auto &shard : shards) {
+        result += shard->memory.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+FileUploadReceiver::Stats FileUploadReceiverEngine::getStats() const {
+    FileUploadReceiver::Stats result;
+
+    for(auto &shard : shards) {
+        const FileUploadReceiver::Stats &stats = shard->receiver.getStats();
+        result.events += stats.events;
+        result.chunks += stats.chunks;
+        result.duplicates += stats.duplicates;
+        result.success += stats.success;
+        result.badHash += stats.badHash;
+        result.badCrc += stats.badCrc;
+        result.badData += stats.badData;
+        result.expired += stats.expired;
+        result.deduped += stats.deduped;
+    }
+    return result;
+}
+
+void FileUploadReceiverEngine::workerThread(Shard *shard) {
+    const auto updatePeriod = std::chrono::milliseconds(100);
+    auto lastUpdate = std::chrono::steady_clock::now();
+    int idleCount = 0;
+
+    while(true) {
+        QueuedEvent *event;
+        if (shard->queue.pop(event)) {
+            idleCount = 0;
+
+            if (event->data.size() >= sizeof(FileUploadReceiver::ChunkHeader)) {
+                // All chunks in an event are for the same file, so the first header identifies the transfer
+                FileUploadReceiver::ChunkHeader ch;
+                memcpy(&ch, event->data.data(), sizeof(ch));
+                shard->startTimes.emplace(event->deviceId + "/" + std::to_string(ch.fileId), event->submitted);
+            }
+
+            shard->receiver.processEvent(event->deviceId, event->data.data(), event->data.size());
+            delete event;
+        }
+        else {
+            if (stopping) {
+                break;
+            }
+            if (++idleCount < 64) {
+                std::this_thread::yield();
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastUpdate >= updatePeriod) {
+            lastUpdate = now;
+
+            shard->receiver.expire();
+
+            // Remove start times for transfers that expired, or late duplicates of completed files
+            auto expireBefore = now - std::chrono::seconds(expireSeconds);
+            for(auto it = shard->startTimes.begin(); it != shard->startTimes.end(); ) {
+                if (it->second < expireBefore) {
+                    it = shard->startTimes.erase(it);
+                }
+                else {
+                    it++;
+                }
+            }
+            shard->inFlight.store(shard->receiver.inFlightCount(), std::memory_order_relaxed);
+            shard->memory.store(shard->receiver.memoryUsage(), std::memory_order_relaxed);
+        }
+    }
+
+    shard->inFlight.store(shard->receiver.inFlightCount(), std::memory_order_relaxed);
+    shard->memory.store(shard->receiver.memoryUsage(), std::memory_order_relaxed);
+}
@@ -0,0 +1,162 @@
+#ifndef __FILEUPLOADRECEIVERENGINE_H
+#define __FILEUPLOADRECEIVERENGINE_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "FileUploadReceiver.h"
+
+/**
+ * @brief Multi-threaded receiver that runs several FileUploadReceiver shards in parallel
+ *
+ * Transfer state is sharded by device ID, so all events from one device are handled by the same
+ * worker thread and the FileUploadReceiver for each shard needs no locking. Events are handed off
+ * to the workers using lock-free queues, and reassembly and hashing happen on the worker threads.
+ *
+ * submit() can be called from any number of threads, for example the threads of a webhook server.
+ */
+class FileUploadReceiverEngine {
+public:
+    /**
+     * @brief Function called when a file has been received and verified
+     *
+     * This is called from a worker thread, and can be called from several worker threads at the
+     * same time. The latency is the time from the first event for the file being submitted until
+     * the file was completed.
+     */
+    typedef std::function<void(const FileUploadReceiver::CompletedFile &completedFile, std::chrono::microseconds latency)> CompletionHandler;
+
+    /**
+     * @brief Function called when a device sends a dedupe probe
+     */
+    typedef std::function<void(const std::string &deviceId, uint32_t fileId, const std::string &hash, bool stored)> ProbeHandler;
+
+    FileUploadReceiverEngine();
+    virtual ~FileUploadReceiverEngine();
+
+    FileUploadReceiverEngine(const FileUploadReceiverEngine&) = delete;
+    FileUploadReceiverEngine& operator=(const FileUploadReceiverEngine&) = delete;
+
+    /**
+     * @brief Number of worker threads (default: number of hardware threads). Set before start().
+     */
+    FileUploadReceiverEngine &withThreads(size_t numThreads) { this->numThreads = numThreads; return *this; };
+
+    /**
+     * @brief Number of events that can be queued for each worker (default: 1024). Set before start().
+     */
+    FileUploadReceiverEngine &withQueueSize(size_t queueSize) { this->queueSize = queueSize; return *this; };
+
+    /**
+     * @brief Directory to store completed and temporary files in. Set before start().
+     */
+    FileUploadReceiverEngine &withOutputDir(const char *outputDir) { this->outputDir = outputDir; return *this; };
+
+    /**
+     * @brief How long a transfer can be idle before it's discarded (default: 300 seconds). Set before start().
+     */
+    FileUploadReceiverEngine &withExpireSeconds(unsigned int expireSeconds) { this->expireSeconds = expireSeconds; return *this; };
+
+    /**
+     * @brief Set the function to call when a file has been received and verified. Set before start().
+     */
+    FileUploadReceiverEngine &withCompletionHandler(CompletionHandler fn) { this->completionHandler = fn; return *this; };
+
+    /**
+     * @brief Set the function to call when a device sends a dedupe probe. Set before start().
+     *
+     * This is called from a worker thread. See FileUploadReceiver::withProbeHandler().
+     */
+    FileUploadReceiverEngine &withProbeHandler(ProbeHandler fn) { this->probeHandler = fn; return *this; };
+
+    /**
+     * @brief Start the worker threads
+     *
+     * If the engine was started before, the previous run is stopped and its receivers are discarded,
+     * so transfers that were not completed and the counters from getStats() do not carry over.
+     */
+    void start();
+
+    /**
+     * @brief Process all queued events, then stop the worker threads
+     *
+     * submit() must not be called at the same time as stop(). After stop(), submit() returns false
+     * until start() is called again.
+     */
+    void stop();
+
+    /**
+     * @brief Queue the binary data from one event for processing
+     *
+     * @param deviceId Device ID that published the event
+     * @param data Event data (binary, already decoded). This is copied.
+     * @param len Length of the event data in bytes
+     * @return true if the event was queued, or false if the engine is not running (start() has not
+     * been called, or stop() has been called)
+     *
+     * If the queue for the worker is full, this waits until there is space.
+     */
+    bool submit(const std::string &deviceId, const uint8_t *data, size_t len);
+
+    /**
+     * @brief Number of transfers in progress, updated periodically by the workers
+     */
+    size_t inFlightCount() const;
+
+    /**
+     * @brief Approximate RAM used by transfers in progress, updated periodically by the workers
+     */
+    size_t memoryUsage() const;
+
+    /**
+     * @brief Counters, summed across all workers. Only valid after stop().
+     */
+    FileUploadReceiver::Stats getStats() const;
+
+protected:
+    /**
+     * @brief An event waiting to be processed by a worker
+     */
+    struct QueuedEvent {
+        std::string deviceId; //!< Device ID that published the event
+        std::vector<uint8_t> data; //!< Event data
+        std::chrono::steady_clock::time_point submitted; //!< When submit() was called
+    };
+
+    /**
+     * @brief One worker thread and the state it owns
+     */
+    struct Shard {
+        explicit Shard(size_t queueSize) : queue(queueSize) {};
+
+        BoundedQueue<QueuedEvent *> queue; //!< Events for this worker
+        FileUploadReceiver receiver; //!< Receiver, only used from the worker thread
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point> startTimes; //!< First event time for each transfer, for latency
+        std::thread thread; //!< Worker thread
+        std::atomic<size_t> inFlight{0}; //!< receiver.inFlightCount(), updated periodically
+        std::atomic<size_t> memory{0}; //!< receiver.memoryUsage(), updated periodically
+    };
+
+    /**
+     * @brief Worker thread function
+     */
+    void workerThread(Shard *shard);
+
+    size_t numThreads; //!< Number of worker threads
+    size_t queueSize = 1024; //!< Events that can be queued for each worker
+    std::string outputDir = "."; //!< Directory for completed and temporary files
+    unsigned int expireSeconds = 300; //!< Idle transfers are discarded after this many seconds
+    CompletionHandler completionHandler = 0; //!< Function to call when a file has been received
+    ProbeHandler probeHandler = 0; //!< Function to call for dedupe probes
+    std::vector<std::unique_ptr<Shard>> shards; //!< One per worker thread
+    std::atomic<bool> stopping{false}; //!< Set by stop() to tell the workers to exit when their queue is empty
+};
+
+#endif // __FILEUPLOADRECEIVERENGINE_H
@@ -0,0 +1,128 @@
+#include "Sha1.h"
+
+#include <string.h>
+
+static inline uint32_t rol(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+void Sha1::reset() {
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+    state[4] = 0xc3d2e1f0;
+    count = 0;
+    blockLen = 0;
+}
+
+void Sha1::update(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+
+    count += len;
+
+    if (blockLen) {
+        size_t copyLen = 64 - blockLen;
+        if (copyLen > len) {
+            copyLen = len;
+        }
+        memcpy(&block[blockLen], p, copyLen);
+        blockLen += copyLen;
+        p += copyLen;
+        len -= copyLen;
+
+        if (blockLen < 64) {
+            return;
+        }
+        transform(block);
+        blockLen = 0;
+    }
+
+    while(len >= 64) {
+        transform(p);
+        p += 64;
+        len -= 64;
+    }
+
+    if (len) {
+        memcpy(block, p, len);
+        blockLen = len;
+    }
+}
+
+void Sha1::final(uint8_t digest[kDigestSize]) {
+    uint64_t bits = count * 8;
+
+    uint8_t pad[72] = {0x80};
+    size_t padLen = (blockLen < 56) ? (56 - blockLen) : (120 - blockLen);
+    for(int ii = 0; ii < 8; ii++) {
+        pad[padLen + ii] = (uint8_t)(bits >> (56 - ii * 8));
+    }
+    update(pad, padLen + 8);
+
+    for(size_t ii = 0; ii < kDigestSize; ii++) {
+        digest[ii] = (uint8_t)(state[ii / 4] >> (24 - (ii % 4) * 8));
+    }
+}
+
+std::string Sha1::finalHex() {
+    static const char hexDigits[] = "0123456789abcdef";
+
+    uint8_t digest[kDigestSize];
+    final(digest);
+
+    std::string result;
+    result.reserve(kDigestSize * 2);
+    for(size_t ii = 0; ii < kDigestSize; ii++) {
+        result += hexDigits[digest[ii] >> 4];
+        result += hexDigits[digest[ii] & 0xf];
+    }
+    return result;
+}
+
+void Sha1::transform(const uint8_t data[64]) {
+    uint32_t w[80];
+
+    for(int ii = 0; ii < 16; ii++) {
+        w[ii] = ((uint32_t)data[ii * 4] << 24) | ((uint32_t)data[ii * 4 + 1] << 16) | ((uint32_t)data[ii * 4 + 2] << 8) | (uint32_t)data[ii * 4 + 3];
+    }
+    for(int ii = 16; ii < 80; ii++) {
+        w[ii] = rol(w[ii - 3] ^ w[ii - 8] ^ w[ii - 14] ^ w[ii - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for(int ii = 0; ii < 80; ii++) {
+        uint32_t f, k;
+        if (ii < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else
+        if (ii < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else
+        if (ii < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = rol(a, 5) + f + e + k + w[ii];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
@@ -0,0 +1,54 @@
+#ifndef __SHA1_H
+#define __SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/**
+ * @brief SHA-1 hash for host-side receivers
+ *
+ * The device uses the SHA1_RK library, which depends on Device OS. This is a standalone
+ * implementation that produces the same hashes.
+ */
+class Sha1 {
+public:
+    static const size_t kDigestSize = 20; //!< Size of a SHA-1 digest in bytes
+
+    Sha1() { reset(); };
+
+    /**
+     * @brief Start a new hash
+     */
+    void reset();
+
+    /**
+     * @brief Add data to the hash
+     *
+     * @param data Pointer to the data
+     * @param len Length of the data in bytes
+     */
+    void update(const void *data, size_t len);
+
+    /**
+     * @brief Finish the hash. Call reset() before reusing the object.
+     *
+     * @param digest Filled in with the 20-byte digest
+     */
+    void final(uint8_t digest[kDigestSize]);
+
+    /**
+     * @brief Finish the hash and return it as a lowercase hex string (40 characters)
+     */
+    std::string finalHex();
+
+protected:
+    void transform(const uint8_t block[64]);
+
+    uint32_t state[5]; //!< Hash state
+    uint64_t count; //!< Number of bytes hashed so far
+    uint8_t block[64]; //!< Partial block
+    size_t blockLen; //!< Number of bytes in block
+};
+
+#endif // __SHA1_H
@@ -0,0 +1,253 @@
+// Microbenchmarks for the per-byte work in the file upload format
+//
+// Host version of src/FileUploadBench.cpp. Times SHA-1 and CRC-32C over several buffer sizes,
+// read() with 512, 4096, and 16384 byte buffers, event assembly using FileUploadEncoder (which
+// also hashes the file for the trailer), version 1 (JSON) and version 2 (binary with CBOR meta
+// data) trailer generation, and hex formatting of the hash.
+// Each test is run several times and the fastest run is reported, as a table on stderr and as
+// JSON lines on stdout with the same fields as the device results, so they can be compared across
+// versions and event sizes.
+//
+// Options:
+//   --event-size N     maximum event size for the event assembly test (default: 16384)
+//   --bytes N          bytes processed by each per-byte test (default: 16777216)
+//   --runs N           number of times to run each test (default: 5)
+//   --temp-file PATH   file to use for the read test (default: /tmp/file-upload-bench.dat)
+
+#include "Crc32cRK.h"
+#include "FileUploadEncoder.h"
+#include "FileUploadReceiver.h"
+#include "Sha1.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+struct Options {
+    size_t eventSize = 16384;
+    size_t bytes = 16 * 1024 * 1024;
+    size_t runs = 5;
+    std::string tempFile = "/tmp/file-upload-bench.dat";
+};
+
+static Options options;
+
+// Keeps results from being optimized away
+static volatile uint32_t sink;
+
+static bool parseOptions(int argc, char *argv[]) {
+    for(int ii = 1; ii < argc; ii++) {
+        std::string arg = argv[ii];
+        const char *value = (ii + 1 < argc) ? argv[ii + 1] : nullptr;
+        if (!value) {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        ii++;
+
+        if (arg == "--event-size") {
+            options.eventSize = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--bytes") {
+            options.bytes = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--runs") {
+            options.runs = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--temp-file") {
+            options.tempFile = value;
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return options.eventSize > sizeof(FileUploadReceiver::ChunkHeader) + sizeof(uint32_t) && options.bytes > 0 && options.runs > 0;
+}
+
+// Runs fn options.runs times and reports the fastest. fn returns the number of iterations it did.
+static void bench(const char *name, size_t size, size_t totalBytes, std::function<size_t()> fn) {
+    size_t iterations = 0;
+    double best = 0;
+
+    for(size_t run = 0; run < options.runs; run++) {
+        auto start = std::chrono::steady_clock::now();
+        iterations = fn();
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || us < best) {
+            best = us;
+        }
+    }
+
+    double bytesPerSec = (best > 0 && totalBytes) ? (totalBytes * 1e6 / best) : 0;
+    double nsPerIteration = iterations ? (best * 1000 / iterations) : 0;
+
+    fprintf(stderr, "%-10s %8zu %10zu %12.0f %12.1f %12.1f\n", name, size, iterations, best, nsPerIteration, bytesPerSec / 1e6);
+    printf("{\"name\":\"%s\",\"size\":%zu,\"iterations\":%zu,\"us\":%.0f,\"bytesPerSec\":%.0f,\"eventSize\":%zu}\n",
+        name, size, iterations, best, bytesPerSec, options.eventSize);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if (!parseOptions(argc, argv)) {
+        return 1;
+    }
+
+    std::mt19937 rng(1234);
+    std::vector<uint8_t> data(std::max(options.bytes, (size_t)16384));
+    for(auto &b : data) {
+        b = (uint8_t) rng();
+    }
+
+    fprintf(stderr, "eventSize=%zu bytes=%zu runs=%zu\n", options.eventSize, options.bytes, options.runs);
+    fprintf(stderr, "%-10s %8s %10s %12s %12s %12s\n", "name", "size", "iterations", "us", "ns/iter", "MB/sec");
+
+    for(size_t size : {64, 512, 4096, 16384}) {
+        bench("sha1", size, options.bytes / size * size, [&]() {
+            Sha1 sha1;
+            size_t iterations = options.bytes / size;
+            for(size_t ii = 0; ii < iterations; ii++) {
+                sha1.update(&data[(ii * size) % (data.size() - size + 1)], size);
+            }
+            sink = sha1.finalHex().size();
+            return iterations;
+        });
+    }
+
+    for(size_t size : {64, 512, 4096, 16384}) {
+        bench("crc32c", size, options.bytes / size * size, [&]() {
+            uint32_t crc = 0;
+            size_t iterations = options.bytes / size;
+            for(size_t ii = 0; ii < iterations; ii++) {
+                crc = Crc32cRK::update(crc, &data[(ii * size) % (data.size() - size + 1)], size);
+            }
+            sink = crc;
+            return iterations;
+        });
+    }
+
+    int fd = open(options.tempFile.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, data.data(), options.bytes) != (ssize_t)options.bytes) {
+        fprintf(stderr, "error writing %s\n", options.tempFile.c_str());
+        return 1;
+    }
+    std::vector<uint8_t> readBuffer(16384);
+    for(size_t size : {512, 4096, 16384}) {
+        bench("read", size, options.bytes, [&]() {
+            size_t iterations = 0;
+            lseek(fd, 0, SEEK_SET);
+            while(read(fd, readBuffer.data(), size) > 0) {
+                iterations++;
+            }
+            return iterations;
+        });
+    }
+    close(fd);
+    unlink(options.tempFile.c_str());
+
+    for(bool chunkCrc : {false, true}) {
+        bench(chunkCrc ? "eventCrc" : "event", options.eventSize, options.bytes, [&]() {
+            auto events = FileUploadEncoder::encode(data.data(), options.bytes, 1234, options.eventSize, chunkCrc);
+            return events.size();
+        });
+    }
+
+    // Same trailers as the device: version 1 JSON, and version 2 TrailerV2 followed by CBOR meta data
+    auto trailerJson = [&](size_t ii) {
+        return "{\"s\":" + std::to_string(options.bytes) + ",\"h\":\"46fbef86972609910f999ff39645443a8fae5fc4\",\"id\":" + std::to_string(ii) +
+            ",\"n\":" + std::to_string(ii) + ",\"e\":0,\"m\":{\"path\":\"/usr/uploadTest/00000001\"}}";
+    };
+    bench("trailer", trailerJson(0).size(), 0, [&]() {
+        const size_t iterations = 100000;
+        size_t jsonSize = 0;
+        for(size_t ii = 0; ii < iterations; ii++) {
+            jsonSize += trailerJson(ii).size();
+        }
+        sink = (uint32_t) jsonSize;
+        return iterations;
+    });
+
+    auto trailerV2 = [&](size_t ii, std::vector<uint8_t> &buf) {
+        FileUploadReceiver::TrailerV2 trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        trailer.fileSize = (uint32_t) options.bytes;
+        memcpy(trailer.hash, data.data(), sizeof(trailer.hash));
+        trailer.chunkCount = (uint32_t) ii;
+        const uint8_t *p = (const uint8_t *)&trailer;
+        buf.assign(p, p + sizeof(trailer));
+
+        // {"path":"/usr/uploadTest/00000001"}
+        auto appendText = [&](const char *str) {
+            size_t len = strlen(str);
+            if (len < 24) {
+                buf.push_back((uint8_t)(0x60 | len));
+            }
+            else {
+                buf.push_back(0x78);
+                buf.push_back((uint8_t) len);
+            }
+            buf.insert(buf.end(), str, str + len);
+        };
+        buf.push_back(0xa1);
+        appendText("path");
+        appendText("/usr/uploadTest/00000001");
+    };
+    std::vector<uint8_t> trailerBuf;
+    trailerBuf.reserve(256);
+    trailerV2(0, trailerBuf);
+    bench("trailerV2", trailerBuf.size(), 0, [&]() {
+        const size_t iterations = 100000;
+        size_t trailerSize = 0;
+        for(size_t ii = 0; ii < iterations; ii++) {
+            trailerV2(ii, trailerBuf);
+            trailerSize += trailerBuf.size();
+        }
+        sink = (uint32_t) trailerSize;
+        return iterations;
+    });
+
+    // snprintf, like String::format on the device, and a lookup table, like Sha1::finalHex()
+    bench("hex", 20, 0, [&]() {
+        const size_t iterations = 100000;
+        for(size_t ii = 0; ii < iterations; ii++) {
+            std::string hash;
+            hash.reserve(40);
+            for(size_t jj = 0; jj < 20; jj++) {
+                char hex[3];
+                snprintf(hex, sizeof(hex), "%02x", (unsigned int)data[ii % 1024 + jj]);
+                hash += hex;
+            }
+            sink = (uint32_t) hash.size();
+        }
+        return iterations;
+    });
+    bench("hexTable", 20, 0, [&]() {
+        static const char hexDigits[] = "0123456789abcdef";
+        const size_t iterations = 100000;
+        for(size_t ii = 0; ii < iterations; ii++) {
+            std::string hash;
+            hash.reserve(40);
+            for(size_t jj = 0; jj < 20; jj++) {
+                uint8_t b = data[ii % 1024 + jj];
+                hash += hexDigits[b >> 4];
+                hash += hexDigits[b & 0xf];
+            }
+            sink = (uint32_t) hash.size();
+        }
+        return iterations;
+    });
+
+    return 0;
+}
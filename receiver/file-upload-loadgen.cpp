@@ -0,0 +1,261 @@
+// Load generator for FileUploadReceiverEngine
+//
+// Simulates a fleet of devices each uploading a file using the FileUploadRK event format,
+// with events reordered, duplicated, and lost at configurable rates, and replays them into
+// the engine from several producer threads. The test is repeated for each thread count and
+// the results are printed as a table on stderr and as JSON lines on stdout.
+//
+// Options:
+//   --devices N        number of simulated devices (default: 1000)
+//   --file-size N      bytes per file (default: 65536)
+//   --event-size N     maximum event size (default: 16384)
+//   --threads A,B,...  worker thread counts to test (default: 1,2,4,8)
+//   --producers N      number of threads calling submit() (default: 2)
+//   --reorder P        probability an event is swapped with a later one (default: 0.2)
+//   --duplicate P      probability an event is sent twice (default: 0.05)
+//   --loss P           probability an event is dropped (default: 0)
+//   --crc              append a CRC-32C to each chunk
+//   --protocol N       protocol version, 1 (JSON trailer) or 2 (binary trailer) (default: 2)
+//   --output-dir DIR   directory for received files (default: /tmp)
+
+#include "FileUploadEncoder.h"
+#include "FileUploadReceiverEngine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    size_t devices = 1000;
+    size_t fileSize = 65536;
+    size_t eventSize = 16384;
+    std::vector<size_t> threads = {1, 2, 4, 8};
+    size_t producers = 2;
+    double reorder = 0.2;
+    double duplicate = 0.05;
+    double loss = 0;
+    bool crc = false;
+    uint8_t protocolVersion = 2;
+    std::string outputDir = "/tmp";
+};
+
+struct SimulatedEvent {
+    std::string deviceId;
+    std::vector<uint8_t> *data;
+};
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+    for(int ii = 1; ii < argc; ii++) {
+        std::string arg = argv[ii];
+        const char *value = (ii + 1 < argc) ? argv[ii + 1] : nullptr;
+
+        if (arg == "--crc") {
+            options.crc = true;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        ii++;
+
+        if (arg == "--devices") {
+            options.devices = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--file-size") {
+            options.fileSize = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--event-size") {
+            options.eventSize = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--threads") {
+            options.threads.clear();
+            for(const char *p = value; *p; ) {
+                options.threads.push_back(strtoul(p, (char **)&p, 10));
+                if (*p == ',') {
+                    p++;
+                }
+            }
+        }
+        else
+        if (arg == "--producers") {
+            options.producers = strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--reorder") {
+            options.reorder = atof(value);
+        }
+        else
+        if (arg == "--duplicate") {
+            options.duplicate = atof(value);
+        }
+        else
+        if (arg == "--loss") {
+            options.loss = atof(value);
+        }
+        else
+        if (arg == "--protocol") {
+            options.protocolVersion = (uint8_t) strtoul(value, nullptr, 10);
+        }
+        else
+        if (arg == "--output-dir") {
+            options.outputDir = value;
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return options.devices > 0 && options.fileSize > 0 && options.producers > 0 && !options.threads.empty();
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    // Generate the event stream once so every thread count replays the same events
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> probability(0.0, 1.0);
+
+    std::deque<std::vector<uint8_t>> eventData; // deque so pointers to the events remain valid
+    std::vector<std::vector<SimulatedEvent>> perDevice(options.devices);
+    std::vector<uint8_t> fileData(options.fileSize);
+
+    for(size_t device = 0; device < options.devices; device++) {
+        char deviceId[32];
+        snprintf(deviceId, sizeof(deviceId), "%024zx", device + 1);
+
+        for(auto &b : fileData) {
+            b = (uint8_t) rng();
+        }
+        auto events = FileUploadEncoder::encode(fileData.data(), fileData.size(), (uint32_t)rng(), options.eventSize, options.crc, "{}", options.protocolVersion);
+
+        std::vector<SimulatedEvent> &sequence = perDevice[device];
+        for(auto &event : events) {
+            eventData.push_back(std::move(event));
+            if (probability(rng) < options.loss) {
+                continue;
+            }
+            sequence.push_back({deviceId, &eventData.back()});
+            if (probability(rng) < options.duplicate) {
+                sequence.push_back({deviceId, &eventData.back()});
+            }
+        }
+        for(size_t ii = 0; ii + 1 < sequence.size(); ii++) {
+            if (probability(rng) < options.reorder) {
+                std::swap(sequence[ii], sequence[ii + 1 + (rng() % (sequence.size() - ii - 1))]);
+            }
+        }
+    }
+
+    // Interleave the devices, as they would be when all uploading at the same time
+    std::vector<SimulatedEvent> stream;
+    size_t totalBytes = 0;
+    for(size_t round = 0; ; round++) {
+        bool any = false;
+        for(auto &sequence : perDevice) {
+            if (round < sequence.size()) {
+                stream.push_back(sequence[round]);
+                totalBytes += sequence[round].data->size();
+                any = true;
+            }
+        }
+        if (!any) {
+            break;
+        }
+    }
+
+    fprintf(stderr, "devices=%zu fileSize=%zu events=%zu bytes=%zu reorder=%.2f duplicate=%.2f loss=%.2f crc=%d protocol=%d\n",
+        options.devices, options.fileSize, stream.size(), totalBytes, options.reorder, options.duplicate, options.loss, (int)options.crc, (int)options.protocolVersion);
+    fprintf(stderr, "%8s %12s %12s %10s %10s %10s %12s\n", "threads", "events/sec", "MB/sec", "completed", "p50 ms", "p99 ms", "bytes/xfer");
+
+    for(size_t numThreads : options.threads) {
+        std::mutex latencyMutex;
+        std::vector<double> latencies;
+        latencies.reserve(options.devices);
+
+        FileUploadReceiverEngine engine;
+        engine
+            .withThreads(numThreads)
+            .withOutputDir(options.outputDir.c_str())
+            .withCompletionHandler([&](const FileUploadReceiver::CompletedFile &completedFile, std::chrono::microseconds latency) {
+                unlink(completedFile.path.c_str());
+                unlink((completedFile.path.substr(0, completedFile.path.size() - 4) + ".json").c_str());
+
+                std::lock_guard<std::mutex> lock(latencyMutex);
+                latencies.push_back(latency.count() / 1000.0);
+            });
+        engine.start();
+
+        std::atomic<bool> producing{true};
+        size_t peakInFlight = 0;
+        size_t peakMemory = 0;
+        std::thread monitor([&]() {
+            while(producing) {
+                size_t inFlight = engine.inFlightCount();
+                if (inFlight > peakInFlight) {
+                    peakInFlight = inFlight;
+                    peakMemory = engine.memoryUsage();
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        });
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> producers;
+        for(size_t producer = 0; producer < options.producers; producer++) {
+            producers.push_back(std::thread([&, producer]() {
+                for(size_t ii = producer; ii < stream.size(); ii += options.producers) {
+                    engine.submit(stream[ii].deviceId, stream[ii].data->data(), stream[ii].data->size());
+                }
+            }));
+        }
+        for(auto &thread : producers) {
+            thread.join();
+        }
+        engine.stop();
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        producing = false;
+        monitor.join();
+
+        // Transfers still in flight had lost events; their temporary files are removed when the engine is destroyed
+        FileUploadReceiver::Stats stats = engine.getStats();
+
+        std::sort(latencies.begin(), latencies.end());
+        double p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+        double p99 = latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+        size_t bytesPerTransfer = peakInFlight ? (peakMemory / peakInFlight) : 0;
+        double eventsPerSec = stream.size() / elapsed;
+        double mbPerSec = totalBytes / elapsed / 1e6;
+
+        fprintf(stderr, "%8zu %12.0f %12.1f %10llu %10.1f %10.1f %12zu\n",
+            numThreads, eventsPerSec, mbPerSec, (unsigned long long)stats.success, p50, p99, bytesPerTransfer);
+
+        printf("{\"threads\":%zu,\"devices\":%zu,\"fileSize\":%zu,\"events\":%zu,\"bytes\":%zu,\"elapsed\":%.3f,\"eventsPerSec\":%.0f,\"bytesPerSec\":%.0f,"
+            "\"completed\":%llu,\"duplicates\":%llu,\"badHash\":%llu,\"p50Ms\":%.2f,\"p99Ms\":%.2f,\"peakInFlight\":%zu,\"bytesPerInFlightTransfer\":%zu}\n",
+            numThreads, options.devices, options.fileSize, stream.size(), totalBytes, elapsed, eventsPerSec, totalBytes / elapsed,
+            (unsigned long long)stats.success, (unsigned long long)stats.duplicates, (unsigned long long)stats.badHash,
+            p50, p99, peakInFlight, bytesPerTransfer);
+        fflush(stdout);
+    }
+
+    return 0;
+}
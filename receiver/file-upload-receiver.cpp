@@ -0,0 +1,109 @@
+// Command line front end for FileUploadReceiver
+//
+// Reads one event per line from stdin in the format:
+//
+//   <deviceId> <data>
+//
+// deviceId must be a 24 character hex Particle device ID; events with anything else are discarded.
+//
+// where data is the event data as sent by a webhook, either as a data URL
+// (data:application/octet-stream;base64,...) or plain Base64. This makes it easy to
+// run behind any local webhook endpoint that appends events to a pipe.
+//
+// Each completed file is written to the output directory and a line of JSON describing
+// it is written to stdout. Dedupe probes write a line of JSON with the event name and data
+// to publish back to the device, and the hash from the probe.
+
+#include "FileUploadReceiver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+static bool base64Decode(const std::string &str, std::vector<uint8_t> &result) {
+    static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    result.clear();
+    result.reserve(str.size() * 3 / 4);
+
+    uint32_t bits = 0;
+    int numBits = 0;
+    for(char c : str) {
+        if (c == '=' || c == '\r' || c == '\n') {
+            continue;
+        }
+        const char *p = strchr(alphabet, c);
+        if (!p || !c) {
+            return false;
+        }
+        bits = (bits << 6) | (uint32_t)(p - alphabet);
+        numBits += 6;
+        if (numBits >= 8) {
+            numBits -= 8;
+            result.push_back((uint8_t)(bits >> numBits));
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    FileUploadReceiver receiver;
+
+    if (argc > 1) {
+        receiver.withOutputDir(argv[1]);
+    }
+
+    receiver.withCompletionHandler([](const FileUploadReceiver::CompletedFile &completedFile) {
+        printf("{\"deviceId\":\"%s\",\"fileId\":%lu,\"path\":\"%s\",\"size\":%llu,\"hash\":\"%s\",\"trailer\":%s}\n",
+            completedFile.deviceId.c_str(), (unsigned long)completedFile.fileId, completedFile.path.c_str(),
+            (unsigned long long)completedFile.size, completedFile.hash.c_str(), completedFile.trailer.c_str());
+        fflush(stdout);
+    });
+
+    receiver.withProbeHandler([](const std::string &deviceId, uint32_t fileId, const std::string &hash, bool stored) {
+        printf("{\"probe\":{\"name\":\"fileUploadProbe/%s\",\"data\":{\"id\":%lu,\"stored\":%s},\"hash\":\"%s\"}}\n",
+            deviceId.c_str(), (unsigned long)fileId, stored ? "true" : "false", hash.c_str());
+        fflush(stdout);
+    });
+
+    std::string line;
+    std::vector<uint8_t> data;
+    while(std::getline(std::cin, line)) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos) {
+            fprintf(stderr, "invalid line (missing data)\n");
+            continue;
+        }
+        std::string deviceId = line.substr(0, space);
+        std::string encoded = line.substr(space + 1);
+
+        if (encoded.compare(0, 5, "data:") == 0) {
+            size_t comma = encoded.find(',');
+            encoded = (comma == std::string::npos) ? "" : encoded.substr(comma + 1);
+        }
+
+        if (!base64Decode(encoded, data)) {
+            fprintf(stderr, "invalid base64 data from %s\n", deviceId.c_str());
+            continue;
+        }
+
+        int result = receiver.processEvent(deviceId, data.data(), data.size());
+        if (result != FileUploadReceiver::kErrorNone) {
+            fprintf(stderr, "processEvent failed %d for %s\n", result, deviceId.c_str());
+        }
+
+        receiver.expire();
+    }
+
+    const FileUploadReceiver::Stats &stats = receiver.getStats();
+    fprintf(stderr, "events=%llu chunks=%llu duplicates=%llu success=%llu badHash=%llu badCrc=%llu badData=%llu expired=%llu deduped=%llu\n",
+        (unsigned long long)stats.events, (unsigned long long)stats.chunks, (unsigned long long)stats.duplicates,
+        (unsigned long long)stats.success, (unsigned long long)stats.badHash, (unsigned long long)stats.badCrc,
+        (unsigned long long)stats.badData, (unsigned long long)stats.expired, (unsigned long long)stats.deduped);
+
+    return 0;
+}
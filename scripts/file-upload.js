@@ -5,6 +5,23 @@ import { dataUrlDecode, base85Encode, base85Decode } from 'particle:encoding';
 
 let sha1; // Defined below
 
+// Files larger than this are streamed out as they are received, instead of being stored in the
+// rick-file-upload ledger. Ledgers are limited to 1 Mbyte and the file is stored Base 85 encoded.
+const kStreamThreshold = 512 * 1024;
+
+// Event published for each streamed chunk and the final manifest. Create a webhook on this event
+// to receive large files.
+const kStreamEventName = 'fileUploadStream';
+
+// Number of hashes of received files to remember per device, for responding to dedupe probes
+const kMaxHashes = 32;
+
+// Largest file accepted, and the smallest chunk size the device can send (1024 byte event, less
+// the 16 byte chunk header and the 4 byte CRC). Together they bound the chunk index, which comes
+// from an unprotected header, so one bad header can't grow the chunk bitmap without limit.
+const kMaxFileSize = 16 * 1024 * 1024;
+const kMinChunkSize = 1024 - 16 - 4;
+
 export default function process({ functionInfo, trigger, event }) {
     try {
         const tempLedger = Particle.ledger("rick-file-upload-temp");
@@ -12,23 +29,56 @@ export default function process({ functionInfo, trigger, event }) {
 
         // console.log('tempLedgerData', tempLedgerData);
 
+        /*
+        The temporary ledger contains:
+        - stats: counters
+        - files: a small summary for each file in progress (received count and bitmap of chunk indexes)
+        - c_<fileId>_<chunkIndex>: one key per chunk, { o: chunkOffset, d: Base85 data }
+
+        Each event only writes the keys it changes using Particle.MERGE, so the amount of data 
+        written per event does not depend on how much of the file has already been received.
+        The whole document is only rewritten (Particle.REPLACE) when a file is completed or 
+        expires, to remove its chunk keys.
+        */
+        const updates = {};
+        let removeKeys = [];
+
         if (!tempLedgerData.data.stats) {
             tempLedgerData.data.stats = {
                 success: 0,
                 badHash: 0,
+                badCrc: 0,
                 expired: 0,
+                deduped: 0,
+                badData: 0,
             };
         }
-
-        // Clean up expired files 
-        if (tempLedgerData.data.files) {
-            const expireBefore = Math.floor(new Date().getTime() / 1000) - 300; // 5 minutes ago
-            for (const fileId in tempLedgerData.data.files) {
-                if (tempLedgerData.data.files[fileId].ts < expireBefore) {
-                    console.log('removing expired file', tempLedgerData.data.files[fileId]);
-                    tempLedgerData.data.stats.expired++;
-                    delete tempLedgerData.data.files[fileId];
-                }
+        if (!tempLedgerData.data.stats.badCrc) {
+            tempLedgerData.data.stats.badCrc = 0;
+        }
+        if (!tempLedgerData.data.stats.deduped) {
+            tempLedgerData.data.stats.deduped = 0;
+        }
+        if (!tempLedgerData.data.stats.badData) {
+            tempLedgerData.data.stats.badData = 0;
+        }
+        if (!tempLedgerData.data.hashes) {
+            tempLedgerData.data.hashes = [];
+        }
+        if (!tempLedgerData.data.files) {
+            tempLedgerData.data.files = {};
+        }
+        const files = tempLedgerData.data.files;
+
+        // Clean up expired files (no chunks received for 5 minutes)
+        const now = Math.floor(new Date().getTime() / 1000);
+        const expireBefore = now - 300; // 5 minutes ago
+        for (const fileId in files) {
+            if ((files[fileId].lastActivity || files[fileId].ts) < expireBefore) {
+                console.log('removing expired file', files[fileId]);
+                tempLedgerData.data.stats.expired++;
+                removeKeys = removeKeys.concat(chunkKeys(files[fileId]));
+                delete files[fileId];
             }
         }
 
@@ -39,35 +89,95 @@ export default function process({ functionInfo, trigger, event }) {
         while (chunkHeaderOffset < decoded.data.length) {
             /*
             struct ChunkHeader { // 16 bytes
-                uint8_t version; //!< Version number (kProtocolVersion = 1)
+                uint8_t version; //!< Version number (1 = JSON trailer, 2 = binary trailer)
                 uint8_t flags; //!< Various flags
-                uint16_t reserved; //!< Reserved for future use
-                uint16_t chunkIndex; //!< 0-based index for which chunk this is
+                uint16_t chunkIndexHigh; //!< Upper 16 bits of the chunk index
+                uint16_t chunkIndex; //!< 0-based index for which chunk this is (lower 16 bits)
                 uint16_t chunkSize; //!< size of this chunk in bytes
                 uint32_t chunkOffset; //!< offset in the file
                 uint32_t fileId; //!< fileId of this chunk
             };
             */
             const kFlagTrailer = 0x01;
+            const kFlagChunkCrc = 0x02;
+            const kFlagProbe = 0x04;
 
             const chunkHeader = {};
             chunkHeader.version = decoded.data[chunkHeaderOffset];
             chunkHeader.flags = decoded.data[chunkHeaderOffset + 1];
-            chunkHeader.chunkIndex = decoded.data[chunkHeaderOffset + 4] | (decoded.data[chunkHeaderOffset + 5] << 8);
+            chunkHeader.chunkIndex = (decoded.data[chunkHeaderOffset + 4] | (decoded.data[chunkHeaderOffset + 5] << 8) | (decoded.data[chunkHeaderOffset + 2] << 16) | (decoded.data[chunkHeaderOffset + 3] << 24)) >>> 0;
             chunkHeader.chunkSize = decoded.data[chunkHeaderOffset + 6] | (decoded.data[chunkHeaderOffset + 7] << 8);
-            chunkHeader.chunkOffset = decoded.data[chunkHeaderOffset + 8] | (decoded.data[chunkHeaderOffset + 9] << 8) | (decoded.data[chunkHeaderOffset + 10] << 16) | (decoded.data[chunkHeaderOffset + 11] << 24);
+            chunkHeader.chunkOffset = (decoded.data[chunkHeaderOffset + 8] | (decoded.data[chunkHeaderOffset + 9] << 8) | (decoded.data[chunkHeaderOffset + 10] << 16) | (decoded.data[chunkHeaderOffset + 11] << 24)) >>> 0;
             chunkHeader.fileId = decoded.data[chunkHeaderOffset + 12] | (decoded.data[chunkHeaderOffset + 13] << 8) | (decoded.data[chunkHeaderOffset + 14] << 16) | (decoded.data[chunkHeaderOffset + 15] << 24);
 
             const dataOffset = chunkHeaderOffset + 16;
             chunkHeaderOffset = dataOffset + chunkHeader.chunkSize;
 
-            if (!tempLedgerData.data.files) {
-                tempLedgerData.data.files = {};
+            if (chunkHeader.version < 1 || chunkHeader.version > 2) {
+                console.log('unsupported protocol version', chunkHeader);
+                break;
             }
-            let tempLedgerFile;
-            if (!tempLedgerData.data.files[chunkHeader.fileId.toString()]) {
-                tempLedgerFile = tempLedgerData.data.files[chunkHeader.fileId.toString()] = {
-                    ts: Math.floor(new Date().getTime() / 1000),
+
+            if (chunkHeader.flags & kFlagChunkCrc) {
+                // 4-byte CRC-32C (little endian) follows the chunk data
+                const expectedCrc = (decoded.data[chunkHeaderOffset] | (decoded.data[chunkHeaderOffset + 1] << 8) | (decoded.data[chunkHeaderOffset + 2] << 16) | (decoded.data[chunkHeaderOffset + 3] << 24)) >>> 0;
+                chunkHeaderOffset += 4;
+
+                const crc = crc32c(decoded.data, dataOffset, dataOffset + chunkHeader.chunkSize);
+                if (crc != expectedCrc) {
+                    // Discard only this chunk; the other chunks for this file are kept
+                    console.log('chunk bad crc', { chunkHeader, crc, expectedCrc });
+                    tempLedgerData.data.stats.badCrc++;
+                    continue;
+                }
+            }
+
+            let trailer;
+            if (chunkHeader.flags & kFlagTrailer) {
+                trailer = parseTrailer(chunkHeader, decoded.data, dataOffset);
+                if (!trailer) {
+                    console.log('invalid trailer', chunkHeader);
+                    tempLedgerData.data.stats.badData++;
+                    continue;
+                }
+            }
+
+            if (chunkHeader.flags & kFlagProbe) {
+                // Dedupe probe (trailer sent before any chunks). Tell the device whether a file with
+                // this hash has already been received so it can skip sending it.
+                const probe = trailer;
+                const stored = tempLedgerData.data.hashes.includes(probe.h);
+                if (stored) {
+                    tempLedgerData.data.stats.deduped++;
+                }
+                console.log('probe', { probe, stored });
+
+                Particle.publish(event.eventName + 'Probe/' + event.deviceId, JSON.stringify({ id: probe.id, stored }), publishOptions(event));
+                continue;
+            }
+
+            const fileKey = chunkHeader.fileId.toString();
+
+            if ((chunkHeader.flags & kFlagTrailer) == 0) {
+                // Validate the chunk position before it is used to size the bitmap
+                const existingTrailer = files[fileKey] && files[fileKey].trailer;
+                const maxSize = existingTrailer ? Math.min(existingTrailer.s, kMaxFileSize) : kMaxFileSize;
+                const maxChunks = existingTrailer ? Math.min(existingTrailer.n, Math.ceil(kMaxFileSize / kMinChunkSize)) : Math.ceil(kMaxFileSize / kMinChunkSize);
+                if (chunkHeader.chunkSize == 0 ||
+                    (chunkHeader.chunkOffset + chunkHeader.chunkSize) > maxSize ||
+                    (chunkHeader.chunkIndex * chunkHeader.chunkSize) > chunkHeader.chunkOffset ||
+                    chunkHeader.chunkIndex >= maxChunks ||
+                    (dataOffset + chunkHeader.chunkSize) > decoded.data.length) {
+                    console.log('invalid chunk', chunkHeader);
+                    tempLedgerData.data.stats.badData++;
+                    continue;
+                }
+            }
+
+            let tempLedgerFile = files[fileKey];
+            if (!tempLedgerFile) {
+                tempLedgerFile = files[fileKey] = {
+                    ts: now,
                     fileId: chunkHeader.fileId,
                     event: {
                         publishedAt: event.publishedAt,
@@ -75,50 +185,106 @@ export default function process({ functionInfo, trigger, event }) {
                         deviceId: event.deviceId,
                         productId: event.productId,
                     },
+                    received: 0,
+                    bitmap: [],
                 }
             }
-            else {
-                tempLedgerFile = tempLedgerData.data.files[chunkHeader.fileId.toString()];
-            }
+            // ts is when the file was started (for elapsed), lastActivity is used for expiration
+            tempLedgerFile.lastActivity = now;
 
-            if (!tempLedgerFile.chunks) {
-                tempLedgerFile.chunks = [];
+            if (!tempLedgerFile.stream && (chunkHeader.chunkOffset + chunkHeader.chunkSize) > kStreamThreshold) {
+                // Too large to store in a ledger, switch to streaming. Chunks already stored are sent first.
+                tempLedgerFile.stream = true;
+                tempLedgerFile.nextChunk = 0;
             }
 
             if ((chunkHeader.flags & kFlagTrailer) == 0) {
-                tempLedgerFile.chunks[chunkHeader.chunkIndex] = {
-                    chunkOffset: chunkHeader.chunkOffset,
-                    chunkSize: chunkHeader.chunkSize,
-                    chunkData: base85Encode(decoded.data.slice(dataOffset, dataOffset + chunkHeader.chunkSize)),
-                }    
+                // One bit per chunk index, so duplicates are not counted twice and no rescan is needed
+                const word = chunkHeader.chunkIndex >>> 5;
+                const bit = 1 << (chunkHeader.chunkIndex & 31);
+                while (tempLedgerFile.bitmap.length <= word) {
+                    tempLedgerFile.bitmap.push(0);
+                }
+                if ((tempLedgerFile.bitmap[word] & bit) == 0) {
+                    tempLedgerFile.bitmap[word] |= bit;
+                    tempLedgerFile.received++;
+
+                    const chunk = {
+                        o: chunkHeader.chunkOffset,
+                        d: base85Encode(decoded.data.slice(dataOffset, dataOffset + chunkHeader.chunkSize)),
+                    };
+                    if (tempLedgerFile.stream && chunkHeader.chunkIndex == tempLedgerFile.nextChunk) {
+                        // Next chunk in order, send it without storing it in the ledger
+                        streamChunk(tempLedgerFile, chunk, decoded.data.slice(dataOffset, dataOffset + chunkHeader.chunkSize));
+                    }
+                    else {
+                        const key = chunkKey(chunkHeader.fileId, chunkHeader.chunkIndex);
+                        tempLedgerData.data[key] = updates[key] = chunk;
+                    }
+                }
             }
             else {
-                let jsonStr = '';
-                for(let ii = 0; ii < chunkHeader.chunkSize; ii++) {
-                    jsonStr += String.fromCharCode(decoded.data[dataOffset + ii]);
-                }
-                tempLedgerFile.trailer = JSON.parse(jsonStr);
+                tempLedgerFile.trailer = trailer;
             }
 
-            let contiguousChunks = true;
-            for (let ii = 0; ii < tempLedgerFile.chunks.length; ii++) {
-                if (!tempLedgerFile.chunks[ii]) {
-                    contiguousChunks = false;
+            if (!tempLedgerFile.stream && tempLedgerFile.trailer && tempLedgerFile.trailer.s > kStreamThreshold) {
+                tempLedgerFile.stream = true;
+                tempLedgerFile.nextChunk = 0;
+            }
+            if (tempLedgerFile.stream) {
+                // Send any stored chunks that are now in order
+                let key;
+                while (tempLedgerData.data[key = chunkKey(tempLedgerFile.fileId, tempLedgerFile.nextChunk)]) {
+                    const chunk = tempLedgerData.data[key];
+                    streamChunk(tempLedgerFile, chunk, base85Decode(chunk.d));
+                    delete tempLedgerData.data[key];
+                    updates[key] = null;
                 }
             }
-            const allChunks = (contiguousChunks && tempLedgerFile.trailer && tempLedgerFile.chunks.length == tempLedgerFile.trailer.n);
 
-            console.log('fileUpload', { chunkHeader, contiguousChunks, allChunks, });
-            // chunk: tempLedgerFile.chunks[chunkHeader.chunkIndex]
+            const allChunks = (tempLedgerFile.trailer && tempLedgerFile.received == tempLedgerFile.trailer.n);
 
-            if (allChunks) {
-                let dataBytes = [];
+            console.log('fileUpload', { chunkHeader, received: tempLedgerFile.received, allChunks, });
 
-                for (let ii = 0; ii < tempLedgerFile.chunks.length; ii++) {
-                    const chunkBytes = base85Decode(tempLedgerFile.chunks[ii].chunkData);
-                    for (const b of chunkBytes) {
-                        dataBytes.push(b);
+            if (allChunks && tempLedgerFile.stream) {
+                if (tempLedgerFile.nextChunk == tempLedgerFile.trailer.n) {
+                    // All chunks have been sent; finish the hash and send the manifest
+                    const hash = sha1Restore(tempLedgerFile.sha1);
+                    hash.update(base85Decode(tempLedgerFile.sha1.tail));
+                    const hashHex = hash.hex();
+                    const valid = (hashHex == tempLedgerFile.trailer.h);
+
+                    publishStream(tempLedgerFile, {
+                        manifest: true,
+                        valid,
+                        hash: hashHex,
+                        event: tempLedgerFile.event,
+                        size: tempLedgerFile.trailer.s,
+                        chunks: tempLedgerFile.trailer.n,
+                        meta: tempLedgerFile.trailer.m,
+                        elapsed: Math.floor(new Date().getTime() / 1000) - tempLedgerFile.ts,
+                    });
+                    console.log('stream complete', { fileId: tempLedgerFile.fileId, valid, hashHex });
+
+                    if (valid) {
+                        tempLedgerData.data.stats.success++;
+                        rememberHash(tempLedgerData.data, hashHex);
+                    }
+                    else {
+                        tempLedgerData.data.stats.badHash++;
                     }
+                    removeKeys = removeKeys.concat(chunkKeys(tempLedgerFile));
+                    delete files[fileKey];
+                }
+            }
+            else
+            if (allChunks) {
+                // Assemble the file into a typed array at each chunk's offset
+                const dataBytes = new Uint8Array(tempLedgerFile.trailer.s);
+                const keys = chunkKeys(tempLedgerFile);
+                for (const key of keys) {
+                    const chunk = tempLedgerData.data[key];
+                    dataBytes.set(base85Decode(chunk.d), chunk.o);
                 }
 
                 const hash = sha1.create();
@@ -142,27 +308,322 @@ export default function process({ functionInfo, trigger, event }) {
                     fileLedgerData.data.fileData = base85Encode(dataBytes);
 
                     fileLedger.set(fileLedgerData.data, Particle.REPLACE);
-                    delete tempLedgerData.data.files[chunkHeader.fileId.toString()];
                     tempLedgerData.data.stats.success++;
+                    rememberHash(tempLedgerData.data, hashHex);
                 }
                 else {
-                    console.log('allChunks bad hash!', { fileData, hashHex });
-                    tempLedgerFile.error = 'complete bad hash';
+                    console.log('allChunks bad hash!', { trailer: tempLedgerFile.trailer, hashHex });
                     tempLedgerData.data.stats.badHash++;
                 }
+                removeKeys = removeKeys.concat(keys);
+                delete files[fileKey];
             }
-
         }
 
-
-        tempLedger.set(tempLedgerData.data, Particle.REPLACE);
-        console.log('tempLedgerData', tempLedgerData);
+        if (removeKeys.length) {
+            // Rewrite the whole document to remove the chunks of completed or expired files,
+            // and chunks of streamed files that were set to null
+            for (const key of removeKeys) {
+                delete tempLedgerData.data[key];
+            }
+            for (const key in tempLedgerData.data) {
+                if (tempLedgerData.data[key] === null) {
+                    delete tempLedgerData.data[key];
+                }
+            }
+            tempLedger.set(tempLedgerData.data, Particle.REPLACE);
+        }
+        else {
+            updates.stats = tempLedgerData.data.stats;
+            updates.files = files;
+            updates.hashes = tempLedgerData.data.hashes;
+            tempLedger.set(updates, Particle.MERGE);
+        }
+        console.log('tempLedgerData', { stats: tempLedgerData.data.stats, files });
     }
     catch (e) {
         console.log('exception', e);
     }
 }
 
+// Publish the next chunk of a streamed file and add it to the running hash
+function streamChunk(tempLedgerFile, chunk, chunkBytes) {
+    publishStream(tempLedgerFile, {
+        i: tempLedgerFile.nextChunk,
+        o: chunk.o,
+        d: chunk.d,
+    });
+
+    // The hash state can only be saved on a 64-byte block boundary, so up to 63 bytes are
+    // carried over to the next chunk in tail
+    const tail = tempLedgerFile.sha1 ? base85Decode(tempLedgerFile.sha1.tail) : new Uint8Array(0);
+    const bytes = new Uint8Array(tail.length + chunkBytes.length);
+    bytes.set(tail, 0);
+    bytes.set(chunkBytes, tail.length);
+    const blockBytes = bytes.length - (bytes.length % 64);
+
+    const hash = sha1Restore(tempLedgerFile.sha1);
+    hash.update(bytes.subarray(0, blockBytes));
+    tempLedgerFile.sha1 = sha1Save(hash, bytes.subarray(blockBytes));
+
+    tempLedgerFile.nextChunk++;
+}
+
+function publishStream(tempLedgerFile, data) {
+    data.fileId = tempLedgerFile.fileId;
+    data.deviceId = tempLedgerFile.event.deviceId;
+
+    Particle.publish(kStreamEventName, JSON.stringify(data), publishOptions(tempLedgerFile.event));
+}
+
+// Options for Particle.publish for an event related to a device
+function publishOptions(event) {
+    const options = { asDeviceId: event.deviceId };
+    if (event.productId) {
+        options.productId = event.productId;
+    }
+    return options;
+}
+
+// Parse the trailer into an object with the same keys for either protocol version: 
+// s (size), h (hash, hex), id (fileId), n (number of chunks), e (elapsed ms), m (meta data).
+// Returns null if the trailer is invalid.
+function parseTrailer(chunkHeader, data, offset) {
+    if (chunkHeader.version == 1) {
+        try {
+            return JSON.parse(bytesToString(data, offset, offset + chunkHeader.chunkSize));
+        }
+        catch (e) {
+            return null;
+        }
+    }
+
+    if (chunkHeader.chunkSize < 32 || offset + chunkHeader.chunkSize > data.length) {
+        // Too small for TrailerV2, or truncated
+        return null;
+    }
+
+    /*
+    struct TrailerV2 { // 32 bytes, followed by the meta data as CBOR, if any
+        uint32_t fileSize; //!< Size of the file in bytes
+        uint8_t hash[20]; //!< SHA-1 hash of the file (binary, not hex)
+        uint32_t chunkCount; //!< Number of chunks (0 for a dedupe probe)
+        uint32_t elapsedMs; //!< Milliseconds from starting the file until the trailer was generated
+    };
+    */
+    const readUint32 = (o) => (data[o] | (data[o + 1] << 8) | (data[o + 2] << 16) | (data[o + 3] << 24)) >>> 0;
+
+    let h = '';
+    for (let ii = 0; ii < 20; ii++) {
+        h += data[offset + 4 + ii].toString(16).padStart(2, '0');
+    }
+
+    const trailer = {
+        s: readUint32(offset),
+        h,
+        id: chunkHeader.fileId >>> 0,
+        n: readUint32(offset + 24),
+        e: readUint32(offset + 28),
+        m: {},
+    };
+    if (chunkHeader.chunkSize > 32) {
+        trailer.m = cborDecode(data, offset + 32, offset + chunkHeader.chunkSize);
+    }
+    return trailer;
+}
+
+// Decode one CBOR item from data[start..end). This supports what encodeToCBOR() on the device 
+// generates for a Variant: integers, strings, binary (as an array of bytes), arrays, maps, 
+// booleans, null, and floating point.
+function cborDecode(data, start, end) {
+    let pos = start;
+
+    const readByte = () => {
+        if (pos >= end) {
+            throw new Error('truncated CBOR');
+        }
+        return data[pos++];
+    };
+    const readUint = (numBytes) => {
+        let value = 0;
+        for (let ii = 0; ii < numBytes; ii++) {
+            value = value * 256 + readByte();
+        }
+        return value;
+    };
+    const readArgument = (info) => {
+        if (info < 24) {
+            return info;
+        }
+        if (info <= 27) {
+            return readUint(1 << (info - 24));
+        }
+        throw new Error('unsupported CBOR argument ' + info);
+    };
+    const decodeItem = () => {
+        const initial = readByte();
+        const major = initial >> 5;
+        const info = initial & 0x1f;
+
+        switch (major) {
+            case 0: // unsigned integer
+                return readArgument(info);
+
+            case 1: // negative integer
+                return -1 - readArgument(info);
+
+            case 2: { // byte string
+                const len = readArgument(info);
+                const bytes = [];
+                for (let ii = 0; ii < len; ii++) {
+                    bytes.push(readByte());
+                }
+                return bytes;
+            }
+
+            case 3: { // text string (UTF-8)
+                const len = readArgument(info);
+                let escaped = '';
+                for (let ii = 0; ii < len; ii++) {
+                    escaped += '%' + readByte().toString(16).padStart(2, '0');
+                }
+                return decodeURIComponent(escaped);
+            }
+
+            case 4: { // array
+                const len = readArgument(info);
+                const result = [];
+                for (let ii = 0; ii < len; ii++) {
+                    result.push(decodeItem());
+                }
+                return result;
+            }
+
+            case 5: { // map
+                const len = readArgument(info);
+                const result = {};
+                for (let ii = 0; ii < len; ii++) {
+                    const key = decodeItem();
+                    result[key] = decodeItem();
+                }
+                return result;
+            }
+
+            case 6: // tag, ignored
+                readArgument(info);
+                return decodeItem();
+
+            default: // simple values and floating point
+                if (info == 20) {
+                    return false;
+                }
+                if (info == 21) {
+                    return true;
+                }
+                if (info == 22 || info == 23) {
+                    return null;
+                }
+                if (info == 25) {
+                    // Half precision
+                    const half = readUint(2);
+                    const exp = (half >> 10) & 0x1f;
+                    const mant = half & 0x3ff;
+                    const value = (exp == 0) ? mant * Math.pow(2, -24) : (exp == 31) ? (mant ? NaN : Infinity) : (mant + 1024) * Math.pow(2, exp - 25);
+                    return (half & 0x8000) ? -value : value;
+                }
+                if (info == 26 || info == 27) {
+                    const numBytes = (info == 26) ? 4 : 8;
+                    const view = new DataView(new ArrayBuffer(numBytes));
+                    for (let ii = 0; ii < numBytes; ii++) {
+                        view.setUint8(ii, readByte());
+                    }
+                    return (info == 26) ? view.getFloat32(0) : view.getFloat64(0);
+                }
+                throw new Error('unsupported CBOR simple value ' + info);
+        }
+    };
+
+    return decodeItem();
+}
+
+function bytesToString(data, start, end) {
+    let str = '';
+    for (let ii = start; ii < end; ii++) {
+        str += String.fromCharCode(data[ii]);
+    }
+    return str;
+}
+
+// Remember the hash of a file that was received successfully, for dedupe probes
+function rememberHash(data, hashHex) {
+    if (!data.hashes.includes(hashHex)) {
+        data.hashes.push(hashHex);
+        if (data.hashes.length > kMaxHashes) {
+            data.hashes.shift();
+        }
+    }
+}
+
+// Create a js-sha1 object from a state saved by sha1Save (or a new one if there is no state)
+function sha1Restore(state) {
+    const hash = sha1.create();
+    if (state) {
+        [hash.h0, hash.h1, hash.h2, hash.h3, hash.h4] = state.h;
+        hash.bytes = state.bytes;
+        hash.hBytes = state.hBytes;
+    }
+    return hash;
+}
+
+// Save the state of a js-sha1 object that has been updated with a multiple of 64 bytes
+function sha1Save(hash, tail) {
+    return {
+        h: [hash.h0, hash.h1, hash.h2, hash.h3, hash.h4],
+        bytes: hash.bytes,
+        hBytes: hash.hBytes,
+        tail: base85Encode(tail),
+    };
+}
+
+function chunkKey(fileId, chunkIndex) {
+    return 'c_' + fileId + '_' + chunkIndex;
+}
+
+// Keys for all of the chunks of a file that have been received, from the bitmap
+function chunkKeys(tempLedgerFile) {
+    const keys = [];
+    const bitmap = tempLedgerFile.bitmap || [];
+    for (let word = 0; word < bitmap.length; word++) {
+        for (let bit = 0; bit < 32; bit++) {
+            if (bitmap[word] & (1 << bit)) {
+                keys.push(chunkKey(tempLedgerFile.fileId, word * 32 + bit));
+            }
+        }
+    }
+    return keys;
+}
+
+let crc32cTable; // Initialized on first use
+
+// CRC-32C (Castagnoli) of data[start..end), matches Crc32cRK on the device
+function crc32c(data, start, end) {
+    if (!crc32cTable) {
+        crc32cTable = new Uint32Array(256);
+        for (let ii = 0; ii < 256; ii++) {
+            let crc = ii;
+            for (let bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? ((crc >>> 1) ^ 0x82f63b78) : (crc >>> 1);
+            }
+            crc32cTable[ii] = crc >>> 0;
+        }
+    }
+
+    let crc = 0xffffffff;
+    for (let ii = start; ii < end; ii++) {
+        crc = crc32cTable[(crc ^ data[ii]) & 0xff] ^ (crc >>> 8);
+    }
+    return (crc ^ 0xffffffff) >>> 0;
+}
 
 /*
 * [js-sha1]{@link https://github.com/emn178/js-sha1}
@@ -0,0 +1,62 @@
+#include "Crc32cRK.h"
+
+#include <string.h>
+
+namespace {
+
+const uint32_t kPolynomial = 0x82f63b78; // CRC-32C (Castagnoli), reversed
+
+struct Crc32cTables {
+    uint32_t t[4][256];
+};
+
+constexpr Crc32cTables makeTables() {
+    Crc32cTables tables = {};
+
+    for(uint32_t ii = 0; ii < 256; ii++) {
+        uint32_t crc = ii;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? ((crc >> 1) ^ kPolynomial) : (crc >> 1);
+        }
+        tables.t[0][ii] = crc;
+    }
+
+    for(uint32_t ii = 0; ii < 256; ii++) {
+        for(int slice = 1; slice < 4; slice++) {
+            uint32_t prev = tables.t[slice - 1][ii];
+            tables.t[slice][ii] = (prev >> 8) ^ tables.t[0][prev & 0xff];
+        }
+    }
+    return tables;
+}
+
+constexpr Crc32cTables tables = makeTables();
+
+}
+
+// [static]
+uint32_t Crc32cRK::update(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+
+    crc = ~crc;
+
+    // Slice-by-4: process 4 bytes per iteration. This assumes a little endian processor,
+    // which is the case for all Particle devices (and x86/ARM hosts).
+    while(len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc ^= word;
+        crc = tables.t[3][crc & 0xff] ^
+            tables.t[2][(crc >> 8) & 0xff] ^
+            tables.t[1][(crc >> 16) & 0xff] ^
+            tables.t[0][crc >> 24];
+        p += 4;
+        len -= 4;
+    }
+
+    while(len-- > 0) {
+        crc = tables.t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,40 @@
+#ifndef __CRC32CRK_H
+#define __CRC32CRK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief CRC-32C (Castagnoli) checksum, used for the optional per-chunk checksum
+ *
+ * This is a table-driven slice-by-4 implementation. The tables are generated at compile time
+ * so they are stored in flash, not RAM (4 Kbytes).
+ *
+ * This class does not depend on Device OS so it can also be used by host-side receivers.
+ */
+class Crc32cRK {
+public:
+    /**
+     * @brief Calculate the CRC-32C of a buffer
+     *
+     * @param data Pointer to the data
+     * @param len Length of the data in bytes
+     * @return uint32_t CRC-32C value
+     */
+    static uint32_t calculate(const void *data, size_t len) { return update(0, data, len); };
+
+    /**
+     * @brief Update a CRC-32C value with additional data
+     *
+     * @param crc Value returned from a previous call to update() or calculate(), or 0 to start
+     * @param data Pointer to the data
+     * @param len Length of the data in bytes
+     * @return uint32_t Updated CRC-32C value
+     *
+     * Calling update() with multiple pieces of data produces the same result as calculate()
+     * with the data concatenated.
+     */
+    static uint32_t update(uint32_t crc, const void *data, size_t len);
+};
+
+#endif // __CRC32CRK_H
@@ -0,0 +1,451 @@
+#include "FileDownloadRK.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "Crc32cRK.h"
+
+FileDownloadRK *FileDownloadRK::_instance;
+
+static Logger _log("app.fileDownload");
+
+
+// [static]
+FileDownloadRK &FileDownloadRK::instance() {
+    if (!_instance) {
+        _instance = new FileDownloadRK();
+    }
+    return *_instance;
+}
+
+FileDownloadRK::FileDownloadRK() {
+}
+
+FileDownloadRK::~FileDownloadRK() {
+}
+
+bool FileDownloadRK::setup() {
+    os_mutex_create(&mutex);
+
+    if (mkdir(downloadDir.c_str(), 0777) != 0 && errno != EEXIST) {
+        _log.error("error creating %s %d", downloadDir.c_str(), errno);
+        return false;
+    }
+
+    String subscribeEventName = eventName + "/" + System.deviceID();
+    Particle.subscribe(subscribeEventName, &FileDownloadRK::eventHandler);
+
+    return true;
+}
+
+
+void FileDownloadRK::loop() {
+    WITH_LOCK(*this) {
+        if (active && !missingReported && millis() - lastChunkTime >= missingReportMs) {
+            // Report missing chunks once per idle period. If chunks are resent, the timer restarts.
+            queueMissingReport();
+            missingReported = true;
+        }
+        if (active && millis() - lastChunkTime >= expireMs) {
+            _log.info("fileId=%lu expired", fileId);
+            endFile(true);
+
+            Variant status;
+            status.set("id", Variant(fileId));
+            status.set("error", Variant("expired"));
+            queueStatus(status);
+        }
+
+        if (!statusQueue.empty() && !cloudEvent.isSending() && Particle.connected()) {
+            const String &status = statusQueue.front();
+            if (CloudEvent::canPublish(status.length())) {
+                cloudEvent.clear();
+                cloudEvent.name(eventName + "Status");
+                cloudEvent.contentType(ContentType::JSON);
+                cloudEvent.write(status.c_str(), status.length());
+                Particle.publish(cloudEvent);
+
+                _log.trace("status %s", status.c_str());
+                statusQueue.pop_front();
+            }
+        }
+    }
+}
+
+// [static]
+void FileDownloadRK::eventHandler(CloudEvent event) {
+    WITH_LOCK(instance()) {
+        instance().processEvent(event);
+    }
+}
+
+void FileDownloadRK::processEvent(CloudEvent &event) {
+    size_t eventSize = event.size();
+    size_t chunkHeaderOffset = 0;
+
+    while(chunkHeaderOffset + sizeof(ChunkHeader) <= eventSize) {
+        ChunkHeader ch;
+        event.seek(chunkHeaderOffset);
+        if (event.read((uint8_t *)&ch, sizeof(ChunkHeader)) != (int)sizeof(ChunkHeader)) {
+            break;
+        }
+
+        size_t crcSize = (ch.flags & FileUploadRK::kFlagChunkCrc) ? sizeof(uint32_t) : 0;
+        size_t dataOffset = chunkHeaderOffset + sizeof(ChunkHeader);
+        if (ch.version < FileUploadRK::kProtocolVersion1 || ch.version > FileUploadRK::kProtocolVersion || (dataOffset + ch.chunkSize + crcSize) > eventSize) {
+            _log.error("invalid chunk header version=%d chunkSize=%d eventSize=%d", (int)ch.version, (int)ch.chunkSize, (int)eventSize);
+            break;
+        }
+        chunkHeaderOffset = dataOffset + ch.chunkSize + crcSize;
+
+        if ((ch.flags & FileUploadRK::kFlagProbe) != 0 || (haveLastCompleted && ch.fileId == lastCompletedFileId)) {
+            // Probes are only used for uploads, and late duplicates of the last completed file are ignored,
+            // even if another download has started, so they don't restart it
+            continue;
+        }
+
+        if (!active || ch.fileId != fileId) {
+            if (!startFile(ch.fileId)) {
+                return;
+            }
+        }
+        lastChunkTime = millis();
+        missingReported = false;
+
+        if (ch.flags & FileUploadRK::kFlagTrailer) {
+            storeTrailer(event, ch);
+        }
+        else {
+            storeChunk(event, ch);
+        }
+
+        checkComplete();
+        if (!active) {
+            break;
+        }
+    }
+}
+
+bool FileDownloadRK::startFile(uint32_t fileId) {
+    if (active) {
+        _log.info("fileId=%lu discarded, fileId=%lu started", this->fileId, fileId);
+        endFile(true);
+    }
+
+    this->fileId = fileId;
+    tempPath = String::format("%s/%lu.part", downloadDir.c_str(), fileId);
+
+    fd = open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        _log.error("error opening %s %d", tempPath.c_str(), errno);
+        return false;
+    }
+
+    chunkBitmap.clear();
+    chunkCount = 0;
+    chunkLimit = 0;
+    SHA1Init(&sha1);
+    hashedOffset = 0;
+    pendingRanges.clear();
+    haveTrailer = false;
+    trailerSize = 0;
+    trailerChunks = 0;
+    trailerHash = "";
+    trailerMeta = Variant();
+    active = true;
+
+    _log.trace("fileId=%lu started", fileId);
+    return true;
+}
+
+void FileDownloadRK::endFile(bool deleteTempFile) {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (deleteTempFile) {
+        unlink(tempPath.c_str());
+    }
+    chunkBitmap.clear();
+    chunkBitmap.shrink_to_fit();
+    pendingRanges.clear();
+    trailerMeta = Variant();
+    active = false;
+}
+
+bool FileDownloadRK::storeChunk(CloudEvent &event, const ChunkHeader &ch) {
+    uint32_t chunkIndex = ((uint32_t)ch.chunkIndexHigh << 16) | ch.chunkIndex;
+
+    // The index sizes chunkBitmap, so check it against the offset: every chunk but the last is full size,
+    // so chunkIndex == chunkOffset / chunkSize, and for the last (shorter) chunk it can only be less.
+    size_t maxSize = maxFileSize;
+    size_t maxChunks = maxFileSize / kMinChunkSize + 1;
+    if (haveTrailer) {
+        maxSize = std::min(maxSize, trailerSize);
+        maxChunks = std::min(maxChunks, trailerChunks);
+    }
+    if (ch.chunkSize == 0 || (uint64_t)ch.chunkOffset + ch.chunkSize > maxSize ||
+        (uint64_t)chunkIndex * ch.chunkSize > ch.chunkOffset || chunkIndex >= maxChunks) {
+        _log.error("invalid chunk index=%lu offset=%lu size=%d", chunkIndex, ch.chunkOffset, (int)ch.chunkSize);
+        return false;
+    }
+
+    size_t word = chunkIndex / 32;
+    uint32_t bit = (uint32_t)1 << (chunkIndex % 32);
+
+    if (word >= chunkBitmap.size()) {
+        chunkBitmap.resize(word + 1);
+    }
+    if (chunkBitmap[word] & bit) {
+        // Duplicate
+        return false;
+    }
+
+    if (lseek(fd, ch.chunkOffset, SEEK_SET) != (off_t)ch.chunkOffset) {
+        _log.error("seek failed %d", errno);
+        return false;
+    }
+
+    // If the chunk is next in order, hash it while copying. The hash state is saved so it can be
+    // restored if the chunk CRC does not match.
+    bool inOrder = (ch.chunkOffset == hashedOffset);
+    SHA1_CTX savedSha1 = sha1;
+    uint32_t crc = 0;
+
+    for(size_t ii = 0; ii < ch.chunkSize; ii += bufferSize) {
+        size_t count = ch.chunkSize - ii;
+        if (count > bufferSize) {
+            count = bufferSize;
+        }
+        if (event.read(buffer, count) != (int)count || write(fd, buffer, count) != (int)count) {
+            _log.error("error copying chunk %lu", chunkIndex);
+            sha1 = savedSha1;
+            return false;
+        }
+        if (ch.flags & FileUploadRK::kFlagChunkCrc) {
+            crc = Crc32cRK::update(crc, buffer, count);
+        }
+        if (inOrder) {
+            SHA1Update(&sha1, (const unsigned char *)buffer, count);
+        }
+    }
+
+    if (ch.flags & FileUploadRK::kFlagChunkCrc) {
+        uint32_t expectedCrc = 0;
+        if (event.read((uint8_t *)&expectedCrc, sizeof(expectedCrc)) != (int)sizeof(expectedCrc) || crc != expectedCrc) {
+            // Discard only this chunk; it will be reported as missing
+            _log.info("chunk %lu CRC mismatch", chunkIndex);
+            sha1 = savedSha1;
+            return false;
+        }
+    }
+
+    chunkBitmap[word] |= bit;
+    chunkCount++;
+    if (chunkIndex >= chunkLimit) {
+        chunkLimit = chunkIndex + 1;
+    }
+
+    size_t start = ch.chunkOffset;
+    size_t end = start + ch.chunkSize;
+    if (inOrder) {
+        hashedOffset = end;
+        if (!hashContiguous()) {
+            _log.error("error reading %s %d", tempPath.c_str(), errno);
+            endFile(true);
+
+            Variant status;
+            status.set("id", Variant(fileId));
+            status.set("error", Variant("file"));
+            queueStatus(status);
+            return false;
+        }
+    }
+    else
+    if (start > hashedOffset) {
+        // Out of order, remember the range and hash it later from the temporary file
+        auto it = pendingRanges.upper_bound(start);
+        if (it != pendingRanges.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= start) {
+                start = prev->first;
+                end = std::max(end, prev->second);
+                it = pendingRanges.erase(prev);
+            }
+        }
+        while(it != pendingRanges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = pendingRanges.erase(it);
+        }
+        pendingRanges[start] = end;
+    }
+    return true;
+}
+
+bool FileDownloadRK::storeTrailer(CloudEvent &event, const ChunkHeader &ch) {
+    if (ch.version != FileUploadRK::kProtocolVersion1) {
+        // Binary trailer, optionally followed by CBOR meta data
+        FileUploadRK::TrailerV2 trailer;
+        if (ch.chunkSize < sizeof(trailer) || event.read((uint8_t *)&trailer, sizeof(trailer)) != (int)sizeof(trailer)) {
+            _log.error("invalid trailer size=%d", (int)ch.chunkSize);
+            return false;
+        }
+
+        trailerMeta = Variant();
+        if (ch.chunkSize > sizeof(trailer) && decodeFromCBOR(trailerMeta, event) < 0) {
+            _log.error("invalid trailer meta data");
+            return false;
+        }
+
+        haveTrailer = true;
+        trailerSize = trailer.fileSize;
+        trailerChunks = trailer.chunkCount;
+        trailerHash = "";
+        for(size_t ii = 0; ii < sizeof(trailer.hash); ii++) {
+            trailerHash += String::format("%02x", (unsigned int)trailer.hash[ii]);
+        }
+        return true;
+    }
+
+    String json;
+    json.reserve(ch.chunkSize);
+    for(size_t ii = 0; ii < ch.chunkSize; ii++) {
+        int c = event.read();
+        if (c < 0) {
+            return false;
+        }
+        json += (char)c;
+    }
+
+    Variant v = Variant::fromJSON(json.c_str());
+    if (!v.has("s") || !v.has("h") || !v.has("n")) {
+        _log.error("invalid trailer %s", json.c_str());
+        return false;
+    }
+
+    haveTrailer = true;
+    trailerSize = (size_t) v.get("s").toUInt();
+    trailerChunks = (size_t) v.get("n").toUInt();
+    trailerHash = v.get("h").toString();
+    trailerMeta = v.get("m");
+    return true;
+}
+
+bool FileDownloadRK::hashContiguous() {
+    while(!pendingRanges.empty()) {
+        auto it = pendingRanges.begin();
+        if (it->first > hashedOffset) {
+            break;
+        }
+
+        if (lseek(fd, hashedOffset, SEEK_SET) != (off_t)hashedOffset) {
+            return false;
+        }
+        for(size_t offset = hashedOffset; offset < it->second; offset += bufferSize) {
+            size_t count = it->second - offset;
+            if (count > bufferSize) {
+                count = bufferSize;
+            }
+            if (read(fd, buffer, count) != (int)count) {
+                return false;
+            }
+            SHA1Update(&sha1, (const unsigned char *)buffer, count);
+        }
+        hashedOffset = std::max(hashedOffset, it->second);
+        pendingRanges.erase(it);
+    }
+    return true;
+}
+
+void FileDownloadRK::checkComplete() {
+    if (!active || !haveTrailer || chunkCount != trailerChunks || hashedOffset != trailerSize) {
+        return;
+    }
+
+    unsigned char digest[20];
+    SHA1Final(digest, &sha1);
+
+    String hash;
+    hash.reserve(sizeof(digest) * 2);
+    for(size_t ii = 0; ii < sizeof(digest); ii++) {
+        hash += String::format("%02x", (unsigned int)digest[ii]);
+    }
+
+    Variant status;
+    status.set("id", Variant(fileId));
+
+    if (hash != trailerHash) {
+        _log.error("fileId=%lu hash mismatch got %s expected %s", fileId, hash.c_str(), trailerHash.c_str());
+        endFile(true);
+
+        status.set("error", Variant("hash"));
+        queueStatus(status);
+        return;
+    }
+
+    // Use the name from the meta data if it's a plain file name, otherwise the fileId
+    String name = trailerMeta.get("name").toString();
+    if (name.length() == 0 || name.indexOf('/') >= 0 || name.startsWith(".")) {
+        name = String(fileId);
+    }
+    String path = downloadDir + "/" + name;
+
+    close(fd);
+    fd = -1;
+    if (rename(tempPath.c_str(), path.c_str()) != 0) {
+        _log.error("error renaming %s to %s %d", tempPath.c_str(), path.c_str(), errno);
+        endFile(true);
+
+        status.set("error", Variant("file"));
+        queueStatus(status);
+        return;
+    }
+    _log.info("fileId=%lu received %s size=%d", fileId, path.c_str(), (int)trailerSize);
+
+    Variant meta = trailerMeta;
+    lastCompletedFileId = fileId;
+    haveLastCompleted = true;
+    endFile(false);
+
+    status.set("ok", Variant(true));
+    queueStatus(status);
+
+    if (completionHandler) {
+        completionHandler(path.c_str(), meta);
+    }
+}
+
+bool FileDownloadRK::haveChunk(size_t chunkIndex) const {
+    size_t word = chunkIndex / 32;
+    return word < chunkBitmap.size() && (chunkBitmap[word] & ((uint32_t)1 << (chunkIndex % 32))) != 0;
+}
+
+void FileDownloadRK::queueStatus(const Variant &status) {
+    statusQueue.push_back(status.toJSON());
+}
+
+void FileDownloadRK::queueMissingReport() {
+    // Without the trailer, only the chunks before the highest chunk index received are known to be missing
+    size_t numChunks = haveTrailer ? trailerChunks : chunkLimit;
+
+    String missing = "[";
+    size_t numRanges = 0;
+    for(size_t ii = 0; ii < numChunks && numRanges < kMaxMissingRanges; ii++) {
+        if (haveChunk(ii)) {
+            continue;
+        }
+        size_t first = ii;
+        while(ii + 1 < numChunks && !haveChunk(ii + 1)) {
+            ii++;
+        }
+        if (numRanges++) {
+            missing += ",";
+        }
+        missing += String::format("[%u,%u]", (unsigned int)first, (unsigned int)ii);
+    }
+    missing += "]";
+
+    String status = String::format("{\"id\":%lu,\"missing\":%s,\"trailer\":%s}", fileId, missing.c_str(), haveTrailer ? "true" : "false");
+    _log.info("fileId=%lu missing report %s", fileId, status.c_str());
+    statusQueue.push_back(status);
+}
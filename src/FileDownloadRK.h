@@ -0,0 +1,301 @@
+#ifndef __FILEDOWNLOADRK_H
+#define __FILEDOWNLOADRK_H
+
+#include "Particle.h"
+
+#ifndef SYSTEM_VERSION_630
+#error "This library requires Device OS 6.3.0 or later"
+#endif
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "FileUploadRK.h"
+#include "SHA1_RK.h"
+
+/**
+ * @brief Receive files from the cloud using the same chunk format as FileUploadRK
+ *
+ * The cloud publishes binary events named eventName + "/" + deviceId (for example
+ * fileDownload/0123456789abcdef01234567), each containing one or more FileUploadRK::ChunkHeader
+ * framed chunks followed by the trailer, exactly as FileUploadRK sends them (protocol version 1 or 2). Each chunk is written
+ * directly to its offset in a temporary file and the SHA-1 hash is calculated as the data becomes
+ * contiguous, so the file is never stored in RAM. When all chunks and the trailer have been received
+ * and the hash matches, the temporary file is renamed and the completion handler is called.
+ *
+ * Status is published in an event named eventName + "Status" with JSON data:
+ * - {"id":fileId,"ok":true} when the file has been received and verified
+ * - {"id":fileId,"error":"hash"} if the hash did not match (the file is discarded)
+ * - {"id":fileId,"error":"expired"} if no chunks were received for the expire time (the file is discarded)
+ * - {"id":fileId,"error":"file"} if the temporary file could not be read or renamed (the file is discarded)
+ * - {"id":fileId,"missing":[[first,last],...],"trailer":false} if no chunks have been received for
+ *   the missing report time. The ranges are inclusive chunk indexes to resend; "trailer" is false if
+ *   the trailer has not been received yet and should be resent as well.
+ *
+ * Only one file is downloaded at a time. Receiving a chunk for a different fileId discards the file
+ * in progress.
+ *
+ * This class is a singleton; you do not create one as a global, on the stack, or with new.
+ *
+ * From global application setup you must call:
+ * FileDownloadRK::instance().setup();
+ *
+ * From global application loop you must call:
+ * FileDownloadRK::instance().loop();
+ */
+class FileDownloadRK {
+public:
+    typedef FileUploadRK::ChunkHeader ChunkHeader; //!< Chunk header, the same as for uploads
+
+    /**
+     * @brief Gets the singleton instance of this class, allocating it if necessary
+     *
+     * Use FileDownloadRK::instance() to instantiate the singleton.
+     */
+    static FileDownloadRK &instance();
+
+    /**
+     * @brief Set the event name to use for downloads (default: fileDownload)
+     *
+     * @param eventName
+     * @return FileDownloadRK&
+     *
+     * The device subscribes to eventName + "/" + deviceId and publishes status in eventName + "Status".
+     *
+     * This must be set before calling setup()!
+     */
+    FileDownloadRK &withEventName(const char *eventName) { this->eventName = eventName; return *this; };
+
+    /**
+     * @brief Directory to store downloaded files in (default: /usr/downloads)
+     *
+     * @param downloadDir
+     * @return FileDownloadRK&
+     *
+     * The file is named using the "name" field in the trailer meta data if present, otherwise the fileId
+     * in decimal. The temporary file is fileId.part in the same directory. The directory is created by
+     * setup() if necessary.
+     *
+     * This must be set before calling setup()!
+     */
+    FileDownloadRK &withDownloadDir(const char *downloadDir) { this->downloadDir = downloadDir; return *this; };
+
+    /**
+     * @brief How long to wait after the last chunk before reporting missing chunks, in milliseconds (default: 10000)
+     *
+     * @param missingReportMs
+     * @return FileDownloadRK&
+     */
+    FileDownloadRK &withMissingReportMs(unsigned long missingReportMs) { this->missingReportMs = missingReportMs; return *this; };
+
+    /**
+     * @brief How long a download can be idle before it's discarded, in milliseconds (default: 300000, 5 minutes)
+     *
+     * @param expireMs
+     * @return FileDownloadRK&
+     */
+    FileDownloadRK &withExpireMs(unsigned long expireMs) { this->expireMs = expireMs; return *this; };
+
+    /**
+     * @brief Largest file that will be accepted, in bytes (default: 1048576, 1 Mbyte)
+     *
+     * @param maxFileSize
+     * @return FileDownloadRK&
+     *
+     * Chunks past this offset are discarded. This also limits the chunk index, and therefore the size
+     * of the chunk bitmap in RAM, to maxFileSize / kMinChunkSize.
+     */
+    FileDownloadRK &withMaxFileSize(size_t maxFileSize) { this->maxFileSize = maxFileSize; return *this; };
+
+    /**
+     * @brief Set the function to call when a file has been received and verified
+     *
+     * @param completionHandler
+     * @return FileDownloadRK&
+     *
+     * The path is the downloaded file and meta is the meta data ("m") from the trailer.
+     */
+    FileDownloadRK &withCompletionHandler(std::function<void(const char *path, const Variant &meta)> completionHandler) { this->completionHandler = completionHandler; return *this; };
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     *
+     * You typically use FileDownloadRK::instance().setup();
+     *
+     * Returns true if the operation succeeded or false if setup failed, typically out of memory.
+     */
+    bool setup();
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     *
+     * You typically use FileDownloadRK::instance().loop();
+     */
+    void loop();
+
+    /**
+     * @brief Locks the mutex that protects shared resources
+     *
+     * This is compatible with `WITH_LOCK(*this)`.
+     *
+     * The mutex is not recursive so do not lock it within a locked section.
+     */
+    void lock() { os_mutex_lock(mutex); };
+
+    /**
+     * @brief Attempts to lock the mutex that protects shared resources
+     *
+     * @return true if the mutex was locked or false if it was busy already.
+     */
+    bool tryLock() { return os_mutex_trylock(mutex); };
+
+    /**
+     * @brief Unlocks the mutex that protects shared resources
+     */
+    void unlock() { os_mutex_unlock(mutex); };
+
+
+protected:
+
+    /**
+     * @brief The constructor is protected because the class is a singleton
+     *
+     * Use FileDownloadRK::instance() to instantiate the singleton.
+     */
+    FileDownloadRK();
+
+    /**
+     * @brief The destructor is protected because the class is a singleton and cannot be deleted
+     */
+    virtual ~FileDownloadRK();
+
+    /**
+     * This class is a singleton and cannot be copied
+     */
+    FileDownloadRK(const FileDownloadRK&) = delete;
+
+    /**
+     * This class is a singleton and cannot be copied
+     */
+    FileDownloadRK& operator=(const FileDownloadRK&) = delete;
+
+    /**
+     * @brief Subscription handler for download events
+     */
+    static void eventHandler(CloudEvent event);
+
+    /**
+     * @brief Process the chunks in one download event
+     */
+    void processEvent(CloudEvent &event);
+
+    /**
+     * @brief Start a new download, discarding any download in progress
+     *
+     * @return true if the temporary file was opened
+     */
+    bool startFile(uint32_t fileId);
+
+    /**
+     * @brief Close the temporary file and discard the download in progress
+     *
+     * @param deleteTempFile true to delete the temporary file
+     */
+    void endFile(bool deleteTempFile);
+
+    /**
+     * @brief Copy one chunk from the event to the temporary file
+     *
+     * @return true if the chunk was stored, false if it was a duplicate, or could not be stored or verified
+     */
+    bool storeChunk(CloudEvent &event, const ChunkHeader &ch);
+
+    /**
+     * @brief Read and parse the trailer from the event
+     */
+    bool storeTrailer(CloudEvent &event, const ChunkHeader &ch);
+
+    /**
+     * @brief Hash any received ranges that are now contiguous with hashedOffset
+     *
+     * @return false if the temporary file could not be read
+     */
+    bool hashContiguous();
+
+    /**
+     * @brief If all chunks and the trailer have been received, verify the hash and finish the file
+     */
+    void checkComplete();
+
+    /**
+     * @brief Returns true if the chunk with this index has been received
+     */
+    bool haveChunk(size_t chunkIndex) const;
+
+    /**
+     * @brief Queue a status event for publishing from loop()
+     */
+    void queueStatus(const Variant &status);
+
+    /**
+     * @brief Queue a status event listing the chunks that have not been received
+     */
+    void queueMissingReport();
+
+    /**
+     * @brief Mutex to protect shared resources
+     *
+     * This is initialized in setup() so make sure you call the setup() method from the global application setup.
+     */
+    os_mutex_t mutex = 0;
+
+    String eventName = "fileDownload"; //!< Event name prefix, set using withEventName()
+    String downloadDir = "/usr/downloads"; //!< Directory for downloaded files, set using withDownloadDir()
+    unsigned long missingReportMs = 10000; //!< Report missing chunks after this long with no chunks received
+    unsigned long expireMs = 300000; //!< Discard a download after this long with no chunks received
+    static const size_t kMaxMissingRanges = 64; //!< Maximum number of ranges in a missing chunks report
+    size_t maxFileSize = 1024 * 1024; //!< Largest file accepted, set using withMaxFileSize()
+    static const size_t kMinChunkSize = 1024 - sizeof(ChunkHeader) - sizeof(uint32_t); //!< Smallest full chunk (1024 byte events with CRC), used to limit the chunk index
+
+    bool active = false; //!< A download is in progress
+    uint32_t fileId = 0; //!< fileId of the download in progress
+    uint32_t lastCompletedFileId = 0; //!< fileId of the last completed download, to ignore late duplicates
+    bool haveLastCompleted = false; //!< lastCompletedFileId is valid
+    String tempPath; //!< Path to the temporary file
+    int fd = -1; //!< File descriptor for tempPath
+    unsigned long lastChunkTime = 0; //!< millis() value when the last chunk was received
+    bool missingReported = false; //!< A missing chunks report has been sent since the last chunk was received
+
+    std::vector<uint32_t> chunkBitmap; //!< One bit per chunk index that has been received
+    size_t chunkCount = 0; //!< Number of bits set in chunkBitmap
+    size_t chunkLimit = 0; //!< One more than the highest chunk index received
+
+    SHA1_CTX sha1; //!< Hash of the bytes from 0 to hashedOffset
+    size_t hashedOffset = 0; //!< Bytes before this offset have been hashed
+    std::map<size_t, size_t> pendingRanges; //!< Received byte ranges after hashedOffset (start -> end), merged
+
+    bool haveTrailer = false; //!< Trailer has been received
+    size_t trailerSize = 0; //!< File size from the trailer ("s")
+    size_t trailerChunks = 0; //!< Number of chunks from the trailer ("n")
+    String trailerHash; //!< SHA-1 hash from the trailer ("h")
+    Variant trailerMeta; //!< Meta data from the trailer ("m")
+
+    static const size_t bufferSize = 512; //!< Internal buffer size, used for copying to and from the file system
+    uint8_t buffer[bufferSize]; //!< Buffer used for copying to and from the file system
+
+    std::deque<String> statusQueue; //!< Status events to publish from loop()
+    CloudEvent cloudEvent; //!< Status event being published
+
+    std::function<void(const char *path, const Variant &meta)> completionHandler = 0; //!< Function to call when a file has been received
+
+    /**
+     * @brief Singleton instance of this class
+     *
+     * The object pointer to this class is stored here. It's NULL at system boot.
+     */
+    static FileDownloadRK *_instance;
+
+};
+
+#endif // __FILEDOWNLOADRK_H
@@ -0,0 +1,170 @@
+#include "FileUploadBench.h"
+
+#include <fcntl.h>
+#include <vector>
+
+#include "Crc32cRK.h"
+#include "FileUploadRK.h"
+#include "SHA1_RK.h"
+
+static Logger _log("app.fileUploadBench");
+
+static const size_t kTestBytes = 65536; //!< Number of bytes processed by each of the per-byte tests
+static const size_t kReadBufferSize = 512; //!< Same as FileUploadRK::bufferSize
+static const size_t kIterations = 100; //!< Iterations for tests that are not per-byte
+
+
+// [static]
+String FileUploadBench::run(size_t eventSize, const char *testPath) {
+    Variant results;
+    std::vector<uint8_t> data(16384);
+    for(size_t ii = 0; ii < data.size(); ii++) {
+        data[ii] = (uint8_t) rand();
+    }
+
+    // SHA-1
+    for(size_t size : {64, 512, 4096, 16384}) {
+        size_t iterations = kTestBytes / size;
+        SHA1_CTX ctx;
+        SHA1Init(&ctx);
+
+        unsigned long start = micros();
+        for(size_t ii = 0; ii < iterations; ii++) {
+            SHA1Update(&ctx, (const unsigned char *)data.data(), size);
+        }
+        unsigned long us = micros() - start;
+
+        unsigned char digest[20];
+        SHA1Final(digest, &ctx);
+        addResult(results, "sha1", size, iterations, us, iterations * size);
+    }
+
+    // CRC-32C
+    {
+        size_t iterations = kTestBytes / kReadBufferSize;
+        uint32_t crc = 0;
+
+        unsigned long start = micros();
+        for(size_t ii = 0; ii < iterations; ii++) {
+            crc = Crc32cRK::update(crc, data.data(), kReadBufferSize);
+        }
+        unsigned long us = micros() - start;
+        addResult(results, "crc32c", kReadBufferSize, iterations, us, kTestBytes);
+    }
+
+    // Create the test file for the read and event tests
+    int fd = open(testPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        _log.error("error creating %s %d", testPath, errno);
+        return "";
+    }
+    for(size_t offset = 0; offset < kTestBytes; offset += data.size()) {
+        write(fd, data.data(), data.size());
+    }
+
+    // read()
+    for(size_t size : {512, 4096, 16384}) {
+        size_t iterations = kTestBytes / size;
+        lseek(fd, 0, SEEK_SET);
+
+        unsigned long start = micros();
+        for(size_t ii = 0; ii < iterations; ii++) {
+            read(fd, data.data(), size);
+        }
+        unsigned long us = micros() - start;
+        addResult(results, "read", size, iterations, us, kTestBytes);
+    }
+
+    close(fd);
+
+    // The remaining tests use the same FileUploadRK::FileSender code that stateSendChunk uses
+    FileUploadRK::UploadQueueEntry queueEntry;
+    queueEntry.path = testPath;
+    queueEntry.immutable = true;
+    queueEntry.meta.set("path", "/usr/uploadTest/00000001");
+    queueEntry.meta.set("numBytes", 65536);
+
+    FileUploadRK::FileSender sender;
+    CloudEvent cloudEvent;
+
+    // Event assembly, the same as stateSendChunk except for publishing
+    for(bool chunkCrc : {false, true}) {
+        // Hashes the file the first time; the digest is cached in queueEntry after that
+        if (sender.start(&queueEntry, 1, data.data(), kReadBufferSize) != SYSTEM_ERROR_NONE) {
+            _log.error("error opening %s %d", testPath, errno);
+            unlink(testPath);
+            return "";
+        }
+        size_t crcSize = chunkCrc ? sizeof(uint32_t) : 0;
+        size_t maxChunkSize = eventSize - sizeof(FileUploadRK::ChunkHeader) - crcSize;
+        uint8_t flags = chunkCrc ? FileUploadRK::kFlagChunkCrc : 0;
+        size_t iterations = 0;
+
+        unsigned long start = micros();
+        while(!sender.allChunksWritten()) {
+            cloudEvent.clear();
+            cloudEvent.name("fileUpload");
+            cloudEvent.contentType(ContentType::BINARY);
+
+            uint32_t crc = 0;
+            sender.writeChunk(cloudEvent, maxChunkSize, flags, data.data(), kReadBufferSize, [&](const uint8_t *buf, size_t len) {
+                if (chunkCrc) {
+                    crc = Crc32cRK::update(crc, buf, len);
+                }
+            });
+            if (chunkCrc) {
+                cloudEvent.write((uint8_t *) &crc, sizeof(crc));
+            }
+            iterations++;
+        }
+        unsigned long us = micros() - start;
+        sender.end();
+        addResult(results, chunkCrc ? "eventCrc" : "event", eventSize, iterations, us, kTestBytes);
+    }
+
+    // Trailer, protocol version 1 (JSON) and 2 (binary with CBOR meta data), as in stateSendChunk
+    for(uint8_t protocolVersion : {(uint8_t)FileUploadRK::kProtocolVersion1, (uint8_t)FileUploadRK::kProtocolVersion}) {
+        sender.protocolVersion = protocolVersion;
+
+        size_t trailerSize = 0;
+        unsigned long start = micros();
+        for(size_t ii = 0; ii < kIterations; ii++) {
+            cloudEvent.clear();
+            sender.prepareTrailer(false);
+            trailerSize = sender.writeTrailer(cloudEvent) - sizeof(FileUploadRK::ChunkHeader);
+        }
+        unsigned long us = micros() - start;
+        addResult(results, (protocolVersion == FileUploadRK::kProtocolVersion1) ? "trailer" : "trailerV2", trailerSize, kIterations, us, 0);
+    }
+
+    // Hex formatting of the hash, used in the version 1 trailer
+    {
+        unsigned long start = micros();
+        for(size_t iter = 0; iter < kIterations; iter++) {
+            sender.hashHex();
+        }
+        unsigned long us = micros() - start;
+        addResult(results, "hex", sizeof(sender.digest), kIterations, us, 0);
+    }
+
+    unlink(testPath);
+
+    Variant v;
+    v.set("protocol", Variant(FileUploadRK::kProtocolVersion));
+    v.set("eventSize", Variant(eventSize));
+    v.set("results", results);
+    return v.toJSON();
+}
+
+// [static]
+void FileUploadBench::addResult(Variant &results, const char *name, size_t size, size_t iterations, unsigned long us, size_t totalBytes) {
+    Variant result;
+    result.set("name", Variant(name));
+    result.set("size", Variant(size));
+    result.set("iterations", Variant(iterations));
+    result.set("us", Variant(us));
+    result.set("bytesPerSec", Variant((us && totalBytes) ? (uint64_t)totalBytes * 1000000 / us : 0));
+    results.append(result);
+
+    _log.trace("%s size=%d iterations=%d us=%lu", name, (int)size, (int)iterations, us);
+}
@@ -0,0 +1,46 @@
+#ifndef __FILEUPLOADBENCH_H
+#define __FILEUPLOADBENCH_H
+
+#include "Particle.h"
+
+/**
+ * @brief Microbenchmarks for the per-byte work done by FileUploadRK
+ *
+ * This times the same operations that FileUploadRK does while sending a file:
+ *
+ * - sha1: SHA-1 hash over buffers of 64, 512, 4096, and 16384 bytes
+ * - read: read() of a test file using buffers of 512, 4096, and 16384 bytes
+ * - event: assembling one event with FileUploadRK::FileSender::writeChunk() and an optional CRC-32C, as stateSendChunk does
+ * - crc32c: CRC-32C over a 512 byte buffer
+ * - trailer: writing the protocol version 1 (JSON) trailer with FileUploadRK::FileSender
+ * - trailerV2: writing the protocol version 2 binary trailer with CBOR meta data with FileUploadRK::FileSender
+ * - hex: formatting the 20-byte SHA-1 digest as hex with FileUploadRK::FileSender::hashHex()
+ *
+ * The results are JSON so they can be compared across library versions and event sizes:
+ *
+ * {"protocol":2,"eventSize":16384,"results":[{"name":"sha1","size":512,"iterations":128,"us":12345,"bytesPerSec":5308},...]}
+ *
+ * us is the total time for all iterations in microseconds. bytesPerSec is 0 for tests that don't
+ * process a fixed number of bytes (trailer, trailerV2, hex). For the trailer tests, size is the trailer size in bytes.
+ *
+ * This is blocking and takes a few seconds, so don't run it from a function or subscription handler.
+ */
+class FileUploadBench {
+public:
+    /**
+     * @brief Run all of the benchmarks
+     *
+     * @param eventSize Event size to use for the event assembly test, like FileUploadRK::withMaxEventSize()
+     * @param testPath Path to a temporary file to use for the read tests. It's deleted when done.
+     * @return String JSON results
+     */
+    static String run(size_t eventSize = 16384, const char *testPath = "/usr/uploadBench");
+
+protected:
+    /**
+     * @brief Add one result to the results array
+     */
+    static void addResult(Variant &results, const char *name, size_t size, size_t iterations, unsigned long us, size_t totalBytes);
+};
+
+#endif // __FILEUPLOADBENCH_H
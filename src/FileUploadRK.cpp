@@ -3,12 +3,36 @@
 #include <fcntl.h>
 #include <dirent.h>
 
-#include "SHA1_RK.h"
+#include "Crc32cRK.h"
 
 FileUploadRK *FileUploadRK::_instance;
 
 static Logger _log("app.fileUpload");
 
+namespace {
+
+// Stream that only counts the bytes written, used to find the size of the CBOR trailer meta data
+class CountingStream : public Stream {
+public:
+    int available() override { return 0; };
+    int read() override { return -1; };
+    int peek() override { return -1; };
+    void flush() override {};
+
+    size_t write(uint8_t b) override {
+        count++;
+        return 1;
+    };
+    size_t write(const uint8_t *data, size_t len) override {
+        count += len;
+        return len;
+    };
+
+    size_t count = 0; //!< Number of bytes written
+};
+
+}
+
 
 // [static]
 FileUploadRK &FileUploadRK::instance() {
@@ -26,7 +50,12 @@ FileUploadRK::~FileUploadRK() {
 
 bool FileUploadRK::setup() {
     os_mutex_create(&mutex);
-    
+
+    if (dedupe) {
+        String probeEventName = eventName + "Probe/" + System.deviceID();
+        Particle.subscribe(probeEventName, &FileUploadRK::probeResponseHandler, this);
+    }
+
     return true;
 }
 
@@ -36,13 +65,14 @@ void FileUploadRK::loop() {
 }
 
 
-int FileUploadRK::queueFileToUpload(const char *path, Variant meta) {
+int FileUploadRK::queueFileToUpload(const char *path, Variant meta, bool immutable) {
     UploadQueueEntry *uploadQueueEntry = new UploadQueueEntry();
     if (!uploadQueueEntry) {
-        return SYSTEM_ERROR_NO_MEMORY;        
+        return SYSTEM_ERROR_NO_MEMORY;
     }
     uploadQueueEntry->path = path;
     uploadQueueEntry->meta = meta;
+    uploadQueueEntry->immutable = immutable;
 
     WITH_LOCK(*this) {
         uploadQueue.push_back(uploadQueueEntry);
@@ -57,9 +87,11 @@ void FileUploadRK::stateStart() {
     static const char *stateName = "stateStart";
 
     if (!Particle.connected()) {
-        // stay in stateStart until connected to the cloud
+        // stay in stateStart until connected to the cloud, hashing queued files in the meantime
+        preparer.loop(*this, uploadQueue, buffer, bufferSize, prepareBytesPerLoop);
         return;
     }
+    preparer.abort();
 
     if (nextFileId == 0) {
         nextFileId = (uint32_t) random();
@@ -71,64 +103,34 @@ void FileUploadRK::stateStart() {
             return;
         }
 
-        const char *path = uploadQueue.front()->path.c_str();
+        UploadQueueEntry *queueEntry = uploadQueue.front();
 
-        _log.trace("%s: processing file %s", stateName, path);
-        fileStartTime = millis();
+        _log.trace("%s: processing file %s", stateName, queueEntry->path.c_str());
 
-        fd = open(path, O_RDONLY);
-        if (fd == -1) {
-            _log.error("%s rror opening %s %d (discarding)", stateName, path, errno);
-            uploadQueue.pop_front();
-            return;
-        }
-
-        {
-            struct stat sb;
-            sb.st_size = 0;
-            fstat(fd, &sb);
-    
-            if (sb.st_size == 0) {
-                _log.info("%s file is empty %s (discarding)", stateName, path);
-                uploadQueue.pop_front();
-                return;
+        int err = sender.start(queueEntry, nextFileId, buffer, bufferSize);
+        if (err) {
+            if (err == SYSTEM_ERROR_INVALID_ARGUMENT) {
+                _log.info("%s file is empty %s (discarding)", stateName, queueEntry->path.c_str());
             }
-            fileSize = (size_t) sb.st_size;    
-        }
-
-        // Calculate the SHA1 hash
-        {
-            SHA1_CTX ctx;
-            SHA1Init(&ctx);
-            for(size_t ii = 0; ii < fileSize; ii += bufferSize) {
-                size_t count = fileSize - ii;
-                if (count > bufferSize) {
-                    count = bufferSize;
-                }
-                read(fd, buffer, count);
-                
-                SHA1Update(&ctx, (const unsigned char *)buffer, count);
-            }   
-            lseek(fd, 0, SEEK_SET);
-            
-            unsigned char digest[20];
-            SHA1Final(digest, &ctx);
-
-            hash = "";
-            hash.reserve(sizeof(digest) * 2);
-            for(size_t ii = 0; ii < sizeof(digest); ii++) {
-                hash += String::format("%02x", (unsigned int)digest[ii]);
+            else {
+                _log.error("%s error opening %s %d (discarding)", stateName, queueEntry->path.c_str(), errno);
             }
+            uploadQueue.pop_front();
+            delete queueEntry;
+            return;
         }
-        fileId = nextFileId++;
-        _log.trace("%s: fileId=%lu size=%d hash=%s", stateName, fileId, (int)fileSize, hash.c_str());
+        nextFileId++;
+        _log.trace("%s: fileId=%lu size=%d hash=%s", stateName, sender.fileId, (int)sender.fileSize, sender.hashHex().c_str());
 
-        chunkOffset = 0;
-        chunkIndex = 0;
         eventOffset = 0;
         trailerSent = false;
 
-        stateHandler = &FileUploadRK::stateSendChunk;
+        if (dedupe) {
+            stateHandler = &FileUploadRK::stateSendProbe;
+        }
+        else {
+            stateHandler = &FileUploadRK::stateSendChunk;
+        }
     }
 
 }
@@ -141,98 +143,48 @@ void FileUploadRK::stateSendChunk() {
         return;
     }
 
-    size_t chunkSize = fileSize - chunkOffset;
-    size_t maxChunkSize = maxEventSize - eventOffset - sizeof(ChunkHeader);
-    if (chunkSize > maxChunkSize) {
-        chunkSize = maxChunkSize;
-    }
-    bool sendTrailer = (chunkOffset >= fileSize);
-
     cloudEvent.clear();
     cloudEvent.name(eventName);
     cloudEvent.contentType(ContentType::BINARY);
-    
+
     eventOffset = 0;
 
-    if (!sendTrailer) {
-        // Add the chunk header
-        {
-            ChunkHeader ch = {0};
-            ch.version = kProtocolVersion;
-            ch.flags = 0;
-            ch.chunkIndex = (uint16_t) chunkIndex++;
-            ch.chunkSize = (uint16_t) chunkSize;
-            ch.chunkOffset = (uint32_t) chunkOffset;
-            ch.fileId = fileId;
-
-            cloudEvent.write((uint8_t *) &ch, sizeof(ChunkHeader));
-            eventOffset += sizeof(ChunkHeader);
-        }
+    if (!sender.allChunksWritten()) {
+        size_t crcSize = chunkCrc ? sizeof(uint32_t) : 0;
+        size_t maxChunkSize = maxEventSize - sizeof(ChunkHeader) - crcSize;
 
-        while(eventOffset < maxEventSize) {
-            size_t count = fileSize - chunkOffset;
-            if (count == 0) {
-                break;
-            }
-    
-            size_t spaceLeft = maxEventSize - eventOffset;
-            if (count > spaceLeft) {
-                count = spaceLeft;
-            }
-            if (count > bufferSize) {
-                count = bufferSize;
+        _log.trace("%s chunkOffset=%d chunkIndex=%d", stateName, (int)sender.chunkOffset, (int)sender.chunkIndex);
+
+        uint32_t crc = 0;
+        eventOffset += sender.writeChunk(cloudEvent, maxChunkSize, chunkCrc ? kFlagChunkCrc : 0, buffer, bufferSize, [&](const uint8_t *data, size_t len) {
+            if (chunkCrc) {
+                crc = Crc32cRK::update(crc, data, len);
             }
-        
-            _log.trace("%s read chunkOffset=%d chunkIndex=%d count=%d", stateName, (int)chunkOffset,(int)chunkIndex, (int)count);
-        
-            read(fd, buffer, count);
-            cloudEvent.write(buffer, count);
-        
-            chunkOffset += count;
-            eventOffset += count;
-        }
+        });
 
+        if (chunkCrc) {
+            cloudEvent.write((uint8_t *) &crc, sizeof(crc));
+            eventOffset += sizeof(crc);
+        }
     }
 
-    sendTrailer = (chunkOffset >= fileSize);
-    if (sendTrailer) {
-        // Generate JSON data 
-        Variant v;
-        v.set("s", Variant(fileSize));
-        v.set("h", Variant(hash.c_str()));
-        v.set("id", Variant(fileId));
-        v.set("n", chunkIndex);
-        v.set("e", millis() - fileStartTime);
-        v.set("m", uploadQueue.front()->meta);
-
-        String json = v.toJSON();
-        size_t jsonSize = json.length();
-
-        if ((eventOffset + sizeof(ChunkHeader) + jsonSize) <= maxEventSize) {
-            // Update chunk header
-            ChunkHeader ch = {0};
-            ch.version = kProtocolVersion;
-            ch.flags = kFlagTrailer;
-            ch.chunkSize = (uint16_t) jsonSize;
-            ch.fileId = fileId;
-    
-            cloudEvent.write((uint8_t *) &ch, sizeof(ChunkHeader));
-            eventOffset += sizeof(ChunkHeader);
-            
-            // JSON data will fit at the end of the event
-            cloudEvent.write(json.c_str(), jsonSize);
-            eventOffset += jsonSize;
-
-            _log.trace("%s: trailer %s", stateName, json.c_str());
+    if (sender.allChunksWritten()) {
+        size_t trailerSize = sender.prepareTrailer(false);
+
+        if ((eventOffset + trailerSize) <= maxEventSize) {
+            // Trailer will fit at the end of the event
+            eventOffset += sender.writeTrailer(cloudEvent);
+
+            _log.trace("%s: trailer version=%d size=%d", stateName, (int)sender.protocolVersion, (int)trailerSize);
 
             trailerSent = true;
         }
         else {
-            _log.trace("%s JSON will be sent in the next event", stateName);
+            _log.trace("%s trailer will be sent in the next event", stateName);
         }
     }
 
-    _log.trace("%s publishing chunkOffset=%d fileSize=%d", stateName, (int)chunkOffset,(int)fileSize);
+    _log.trace("%s publishing chunkOffset=%d fileSize=%d", stateName, (int)sender.chunkOffset,(int)sender.fileSize);
     Particle.publish(cloudEvent);
 
     stateHandler = &FileUploadRK::stateWaitPublishComplete;
@@ -248,7 +200,8 @@ void FileUploadRK::stateWaitPublishComplete() {
 
     int err = cloudEvent.error();
     if (err) {
-        _log.trace("%s publish failed %d at chunkOffset=%d fileSize=%d", stateName, err, (int)chunkOffset,(int)fileSize);
+        _log.trace("%s publish failed %d at chunkOffset=%d fileSize=%d", stateName, err, (int)sender.chunkOffset,(int)sender.fileSize);
+        sender.end();
 
         stateTime = millis();
         stateHandler = &FileUploadRK::stateWaitBeforeRetry;
@@ -258,12 +211,99 @@ void FileUploadRK::stateWaitPublishComplete() {
     if (!trailerSent) {
         stateHandler = &FileUploadRK::stateSendChunk;
     } else {
-        if (completionHandler) {
-            completionHandler(uploadQueue.front());
+        fileComplete();
+    }
+}
+
+void FileUploadRK::stateSendProbe() {
+    static const char *stateName = "stateSendProbe";
+
+    size_t probeSize = sender.prepareTrailer(true);
+
+    if (!CloudEvent::canPublish(probeSize)) {
+        return;
+    }
+
+    cloudEvent.clear();
+    cloudEvent.name(eventName);
+    cloudEvent.contentType(ContentType::BINARY);
+
+    sender.writeTrailer(cloudEvent);
+
+    WITH_LOCK(*this) {
+        probeResult = kProbeNoResponse;
+    }
+
+    _log.trace("%s: probe fileId=%lu", stateName, sender.fileId);
+    Particle.publish(cloudEvent);
+
+    stateTime = millis();
+    stateHandler = &FileUploadRK::stateWaitProbeResponse;
+}
+
+void FileUploadRK::stateWaitProbeResponse() {
+    static const char *stateName = "stateWaitProbeResponse";
+
+    if (cloudEvent.isSending()) {
+        return;
+    }
+
+    int err = cloudEvent.error();
+    if (err) {
+        _log.trace("%s probe publish failed %d", stateName, err);
+        sender.end();
+
+        stateTime = millis();
+        stateHandler = &FileUploadRK::stateWaitBeforeRetry;
+        return;
+    }
+
+    int result;
+    WITH_LOCK(*this) {
+        result = probeResult;
+    }
+
+    if (result == kProbeStored) {
+        _log.info("%s: fileId=%lu already stored in the cloud, not sending", stateName, sender.fileId);
+        fileComplete();
+    }
+    else
+    if (result == kProbeNotStored || millis() - stateTime >= probeTimeoutMs) {
+        _log.trace("%s: fileId=%lu sending (%s)", stateName, sender.fileId, (result == kProbeNotStored) ? "not stored" : "timeout");
+        stateHandler = &FileUploadRK::stateSendChunk;
+    }
+}
+
+void FileUploadRK::probeResponseHandler(const char *eventName, const char *data) {
+    WITH_LOCK(*this) {
+        int result = parseProbeResponse(data, sender.fileId);
+        if (result != kProbeNoResponse) {
+            probeResult = result;
         }
+    }
+}
+
+// [static]
+int FileUploadRK::parseProbeResponse(const char *data, uint32_t fileId) {
+    Variant v = Variant::fromJSON(data);
+
+    if ((uint32_t)v.get("id").toUInt() != fileId) {
+        return kProbeNoResponse;
+    }
+    return v.get("stored").toBool() ? kProbeStored : kProbeNotStored;
+}
+
+void FileUploadRK::fileComplete() {
+    sender.end();
+
+    if (completionHandler) {
+        completionHandler(uploadQueue.front());
+    }
+    WITH_LOCK(*this) {
+        delete uploadQueue.front();
         uploadQueue.pop_front();
-        stateHandler = &FileUploadRK::stateStart;
     }
+    stateHandler = &FileUploadRK::stateStart;
 }
 
 
@@ -271,9 +311,207 @@ void FileUploadRK::stateWaitBeforeRetry() {
     // static const char *stateName = "stateWaitBeforeRetry";
 
     if (millis() - stateTime < retryWaitMs) {
+        preparer.loop(*this, uploadQueue, buffer, bufferSize, prepareBytesPerLoop);
         return;
     }
 
     stateHandler = &FileUploadRK::stateStart;
 }
 
+
+int FileUploadRK::FileSender::start(UploadQueueEntry *queueEntry, uint32_t fileId, uint8_t *buffer, size_t bufferSize) {
+    // Close the previous file, if end() was not called
+    end();
+
+    this->queueEntry = queueEntry;
+    this->fileId = fileId;
+    fileStartTime = millis();
+    chunkOffset = 0;
+    chunkIndex = 0;
+
+    fd = open(queueEntry->path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+
+    struct stat sb;
+    sb.st_size = 0;
+    fstat(fd, &sb);
+
+    if (sb.st_size == 0) {
+        end();
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+    fileSize = (size_t) sb.st_size;
+
+    if (queueEntry->immutable && queueEntry->prepared && queueEntry->fileSize == fileSize) {
+        // Hashed while offline (or on a previous attempt). LittleFS does not keep modification times, so
+        // only files the application said won't change are trusted.
+        memcpy(digest, queueEntry->digest, sizeof(digest));
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // Calculate the SHA1 hash
+    SHA1_CTX ctx;
+    SHA1Init(&ctx);
+    for(size_t ii = 0; ii < fileSize; ii += bufferSize) {
+        size_t count = fileSize - ii;
+        if (count > bufferSize) {
+            count = bufferSize;
+        }
+        read(fd, buffer, count);
+
+        SHA1Update(&ctx, (const unsigned char *)buffer, count);
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    SHA1Final(digest, &ctx);
+
+    if (queueEntry->immutable) {
+        // Save it so a retry after a publish error does not need to hash again
+        memcpy(queueEntry->digest, digest, sizeof(digest));
+        queueEntry->fileSize = fileSize;
+        queueEntry->prepared = true;
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void FileUploadRK::FileSender::end() {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+void FileUploadRK::FileSender::writeChunkHeader(CloudEvent &event, uint8_t flags, size_t chunkIndex, size_t chunkSize, size_t chunkOffset) {
+    ChunkHeader ch = {0};
+    ch.version = protocolVersion;
+    ch.flags = flags;
+    ch.chunkIndexHigh = (uint16_t) (chunkIndex >> 16);
+    ch.chunkIndex = (uint16_t) chunkIndex;
+    ch.chunkSize = (uint16_t) chunkSize;
+    ch.chunkOffset = (uint32_t) chunkOffset;
+    ch.fileId = fileId;
+
+    event.write((uint8_t *) &ch, sizeof(ChunkHeader));
+}
+
+size_t FileUploadRK::FileSender::prepareTrailer(bool probe) {
+    trailerProbe = probe;
+
+    if (protocolVersion == kProtocolVersion1) {
+        Variant v;
+        v.set("s", Variant(fileSize));
+        v.set("h", Variant(hashHex()));
+        v.set("id", Variant(fileId));
+        if (!probe) {
+            v.set("n", chunkIndex);
+            v.set("e", millis() - fileStartTime);
+            v.set("m", queueEntry->meta);
+        }
+        trailerJson = v.toJSON();
+        trailerSize = trailerJson.length();
+        return sizeof(ChunkHeader) + trailerSize;
+    }
+
+    trailerV2.fileSize = (uint32_t) fileSize;
+    memcpy(trailerV2.hash, digest, sizeof(trailerV2.hash));
+    trailerV2.chunkCount = probe ? 0 : (uint32_t) chunkIndex;
+    trailerV2.elapsedMs = probe ? 0 : (uint32_t) (millis() - fileStartTime);
+    trailerSize = sizeof(TrailerV2);
+
+    // The meta data is encoded directly into the event by writeTrailer(); this only finds its size
+    if (!probe && !queueEntry->meta.isNull()) {
+        CountingStream stream;
+        encodeToCBOR(queueEntry->meta, stream);
+        trailerSize += stream.count;
+    }
+    return sizeof(ChunkHeader) + trailerSize;
+}
+
+size_t FileUploadRK::FileSender::writeTrailer(CloudEvent &event) {
+    writeChunkHeader(event, trailerProbe ? (kFlagTrailer | kFlagProbe) : kFlagTrailer, 0, trailerSize, 0);
+
+    if (protocolVersion == kProtocolVersion1) {
+        event.write((const uint8_t *) trailerJson.c_str(), trailerSize);
+    }
+    else {
+        event.write((const uint8_t *) &trailerV2, sizeof(TrailerV2));
+        if (!trailerProbe && !queueEntry->meta.isNull()) {
+            encodeToCBOR(queueEntry->meta, event);
+        }
+    }
+
+    return sizeof(ChunkHeader) + trailerSize;
+}
+
+String FileUploadRK::FileSender::hashHex() const {
+    String hash;
+    hash.reserve(sizeof(digest) * 2);
+    for(size_t ii = 0; ii < sizeof(digest); ii++) {
+        hash += String::format("%02x", (unsigned int)digest[ii]);
+    }
+    return hash;
+}
+
+
+void FileUploadRK::FilePreparer::abort() {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    queueEntry = nullptr;
+}
+
+bool FileUploadRK::FilePreparer::start() {
+    fd = open(queueEntry->path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        // stateStart will discard it
+        queueEntry->prepared = true;
+        queueEntry = nullptr;
+        return false;
+    }
+
+    struct stat sb;
+    sb.st_size = 0;
+    fstat(fd, &sb);
+
+    queueEntry->fileSize = (size_t) sb.st_size;
+    offset = 0;
+    SHA1Init(&ctx);
+    return true;
+}
+
+void FileUploadRK::FilePreparer::hash(uint8_t *buffer, size_t bufferSize, size_t maxBytes) {
+    static const char *stateName = "prepareQueuedFile";
+
+    size_t end = offset + maxBytes;
+    if (end > queueEntry->fileSize) {
+        end = queueEntry->fileSize;
+    }
+    while(offset < end) {
+        size_t count = end - offset;
+        if (count > bufferSize) {
+            count = bufferSize;
+        }
+        int res = read(fd, buffer, count);
+        if (res <= 0) {
+            // File was truncated; the size will not match in stateStart so it will be hashed again there
+            _log.trace("%s: read error %s at %d", stateName, queueEntry->path.c_str(), (int)offset);
+            queueEntry->fileSize = 0;
+            queueEntry->prepared = true;
+            abort();
+            return;
+        }
+        SHA1Update(&ctx, (const unsigned char *)buffer, res);
+        offset += res;
+    }
+
+    if (offset >= queueEntry->fileSize) {
+        SHA1Final(queueEntry->digest, &ctx);
+        queueEntry->prepared = true;
+        _log.trace("%s: %s size=%d", stateName, queueEntry->path.c_str(), (int)queueEntry->fileSize);
+        abort();
+    }
+}
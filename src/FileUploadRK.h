@@ -10,6 +10,8 @@
 #include <deque>
 #include <sys/stat.h>
 
+#include "SHA1_RK.h"
+
 /**
  * This class is a singleton; you do not create one as a global, on the stack, or with new.
  * 
@@ -25,15 +27,28 @@ public:
      * @brief Structure that precedes data in an event
      */
     struct ChunkHeader { // 16 bytes
-        uint8_t version; //!< Version number (kProtocolVersion = 1)
-        uint8_t flags; //!< Various flags
-        uint16_t reserved; //!< Reserved for future use
-        uint16_t chunkIndex; //!< 0-based index for which chunk this is
+        uint8_t version; //!< Version number (kProtocolVersion = 2, or kProtocolVersion1 = 1)
+        uint8_t flags; //!< Various flags (kFlagTrailer, kFlagChunkCrc)
+        uint16_t chunkIndexHigh; //!< Upper 16 bits of the chunk index (0 unless the file has more than 65535 chunks)
+        uint16_t chunkIndex; //!< 0-based index for which chunk this is (lower 16 bits)
         uint16_t chunkSize; //!< size of this chunk in bytes
         uint32_t chunkOffset; //!< offset in the file
         uint32_t fileId; //!< fileId of this chunk
     };
 
+    /**
+     * @brief Trailer data for protocol version 2
+     * 
+     * In version 1, the trailer is JSON. In version 2, it's this binary structure (little endian),
+     * followed by the meta data encoded as CBOR if there is any meta data.
+     */
+    struct TrailerV2 { // 32 bytes
+        uint32_t fileSize; //!< Size of the file in bytes
+        uint8_t hash[20]; //!< SHA-1 hash of the file (binary, not hex)
+        uint32_t chunkCount; //!< Number of chunks (0 for a dedupe probe)
+        uint32_t elapsedMs; //!< Milliseconds from starting the file until the trailer was generated (0 for a dedupe probe)
+    };
+
     /**
      * @brief Structure to hold a file to upload. This is passed to the completionHandler
      */
@@ -41,6 +56,11 @@ public:
         public:
             String path; //!< Path to file on the POSIX flash file system.
             Variant meta; //!< VariantMap of additional data to include. This must be serializable to JSON (no buffers).
+
+            bool immutable = false; //!< The file will not be modified after being queued, so its hash can be saved and reused
+            bool prepared = false; //!< fileSize and digest are valid (immutable file was hashed while offline or on a previous attempt)
+            size_t fileSize = 0; //!< Size of the file when it was hashed
+            uint8_t digest[20]; //!< SHA-1 hash of the file (binary)
         };
     
     /**
@@ -73,6 +93,69 @@ public:
      */
     FileUploadRK &withMaxEventSize(size_t maxEventSize) { this->maxEventSize = maxEventSize; return  *this; };
 
+    /**
+     * @brief Append a CRC-32C checksum to each chunk (default: false)
+     * 
+     * @param enable 
+     * @return FileUploadRK& 
+     * 
+     * When enabled, the 4-byte CRC-32C of the chunk data (little endian) is written after the chunk
+     * data and kFlagChunkCrc is set in the chunk header. This allows the receiver to detect a corrupted
+     * chunk when it is received, instead of only detecting it from the file hash after all chunks
+     * have been received. The chunkSize in the header does not include the 4-byte checksum.
+     */
+    FileUploadRK &withChunkCrc(bool enable = true) { this->chunkCrc = enable; return *this; };
+
+    /**
+     * @brief Protocol version to send (default: kProtocolVersion, 2)
+     * 
+     * @param protocolVersion 2 for a binary trailer with CBOR meta data, or 1 for a JSON trailer
+     * @return FileUploadRK& 
+     * 
+     * Version 1 can be used if the receiver has not been updated to handle version 2. The
+     * chunks are the same in both versions; only the trailer is different.
+     */
+    FileUploadRK &withProtocolVersion(uint8_t protocolVersion) { sender.protocolVersion = protocolVersion; return *this; };
+
+    /**
+     * @brief Ask the cloud if it already has the file before sending it (default: false)
+     * 
+     * @param enable 
+     * @return FileUploadRK& 
+     * 
+     * When enabled, after the file is hashed only the trailer is sent, with kFlagProbe set. The
+     * receiver responds with an event named eventName + "Probe/" + deviceId (for example 
+     * fileUploadProbe/0123456789abcdef01234567) containing JSON with "id" (fileId) and "stored"
+     * (true if a file with that hash has already been received from this device). If it's 
+     * already stored, the completion handler is called without sending any chunks.
+     * 
+     * If no response is received within the probe timeout, the file is sent normally.
+     * 
+     * This must be set before calling setup()!
+     */
+    FileUploadRK &withDedupe(bool enable = true) { this->dedupe = enable; return *this; };
+
+    /**
+     * @brief How long to wait for a response to a dedupe probe, in milliseconds (default: 30000)
+     * 
+     * @param probeTimeoutMs 
+     * @return FileUploadRK& 
+     */
+    FileUploadRK &withProbeTimeoutMs(unsigned long probeTimeoutMs) { this->probeTimeoutMs = probeTimeoutMs; return *this; };
+
+    /**
+     * @brief Set how many bytes of queued files to hash per call to loop() while offline (default: 4096)
+     * 
+     * @param prepareBytesPerLoop Number of bytes, or 0 to disable hashing while offline
+     * @return FileUploadRK& 
+     * 
+     * While not connected to the cloud, queued files are hashed in the background, a few bytes at a time
+     * so loop() does not block for long. The size and hash are saved in the queue entry, so when the
+     * connection comes up the first chunk can be sent immediately instead of reading the whole file first.
+     * Only files queued as immutable are hashed in advance, because the file system does not keep
+     * modification times, so a file rewritten with the same size can't be detected.
+     */
+    FileUploadRK &withPrepareBytesPerLoop(size_t prepareBytesPerLoop) { this->prepareBytesPerLoop = prepareBytesPerLoop; return *this; };
 
     /**
      * @brief Set the function to call when a file has been successfully sent
@@ -102,9 +185,13 @@ public:
      * @brief Enqueue a file to upload
      * 
      * @param path 
+     * @param meta Additional data to include in the trailer
+     * @param immutable Set to true if the file will not be modified until it has been sent. This allows
+     * it to be hashed while offline and the hash to be reused after a publish error. Otherwise the file
+     * is hashed again each time sending starts.
      * @return int 
      */
-    int queueFileToUpload(const char *path, Variant meta = {});
+    int queueFileToUpload(const char *path, Variant meta = {}, bool immutable = false);
 
     /**
      * @brief Locks the mutex that protects shared resources
@@ -127,11 +214,200 @@ public:
      */
     void unlock() { os_mutex_unlock(mutex); };
 
-    static const uint16_t kProtocolVersion = 1; //!< Version number of the file upload protocol
+    static const uint16_t kProtocolVersion = 2; //!< Version number of the file upload protocol (binary trailer)
+
+    static const uint16_t kProtocolVersion1 = 1; //!< Previous version of the file upload protocol (JSON trailer)
 
 
     static const uint8_t kFlagTrailer = 0x01; //!< Chunk is the trailer, not actually a chunk
 
+    static const uint8_t kFlagChunkCrc = 0x02; //!< Chunk data is followed by a 4-byte CRC-32C of the chunk data
+
+    static const uint8_t kFlagProbe = 0x04; //!< Trailer is a dedupe probe, sent before any chunks (used with kFlagTrailer)
+
+    static const int kProbeNoResponse = 0; //!< Probe response: no response yet, or for a different fileId
+    static const int kProbeStored = 1; //!< Probe response: cloud already has the file
+    static const int kProbeNotStored = 2; //!< Probe response: cloud does not have the file
+
+    /**
+     * @brief Parse the JSON data from a dedupe probe response
+     * 
+     * @param data Event data, {"id":fileId,"stored":bool}
+     * @param fileId fileId of the probe that was sent
+     * @return int kProbeStored, kProbeNotStored, or kProbeNoResponse if the response is for a different fileId
+     */
+    static int parseProbeResponse(const char *data, uint32_t fileId);
+
+    /**
+     * @brief Sends one file: opens and hashes it, then writes its chunks, trailer, and dedupe probe to events
+     * 
+     * This is shared by FileUploadRK and FileUploaderRK so they send exactly the same events. The
+     * state machine, event size, and read buffer belong to the class that uses it.
+     */
+    class FileSender {
+    public:
+        /**
+         * @brief Open the file for a queue entry and get its size and hash
+         * 
+         * @param queueEntry The file to send. If it's immutable, was prepared, and the size has not changed,
+         * the saved hash is used. Otherwise the file is hashed, and the hash is saved if it's immutable.
+         * @param fileId fileId to send the file as
+         * @param buffer Buffer to read the file with
+         * @param bufferSize Size of buffer in bytes
+         * @return int SYSTEM_ERROR_NONE, or an error if the file can't be opened or is empty (discard it)
+         */
+        int start(UploadQueueEntry *queueEntry, uint32_t fileId, uint8_t *buffer, size_t bufferSize);
+
+        /**
+         * @brief Close the file, if open
+         */
+        void end();
+
+        /**
+         * @brief Returns true if all of the chunk data has been written (the trailer is next)
+         */
+        bool allChunksWritten() const { return chunkOffset >= fileSize; };
+
+        /**
+         * @brief Write the next chunk header and chunk data to an event
+         * 
+         * @param event Event to write to
+         * @param maxChunkSize Maximum number of bytes of chunk data
+         * @param flags Flags for the chunk header, such as kFlagChunkCrc
+         * @param buffer Buffer to read the file with
+         * @param bufferSize Size of buffer in bytes
+         * @param onChunkData Called with each block of chunk data as it's written, for example to calculate a CRC
+         * @return size_t Number of bytes written to the event
+         */
+        template<class ChunkDataFn>
+        size_t writeChunk(CloudEvent &event, size_t maxChunkSize, uint8_t flags, uint8_t *buffer, size_t bufferSize, ChunkDataFn onChunkData) {
+            size_t chunkSize = fileSize - chunkOffset;
+            if (chunkSize > maxChunkSize) {
+                chunkSize = maxChunkSize;
+            }
+            writeChunkHeader(event, flags, chunkIndex++, chunkSize, chunkOffset);
+
+            size_t chunkEnd = chunkOffset + chunkSize;
+            while(chunkOffset < chunkEnd) {
+                size_t count = chunkEnd - chunkOffset;
+                if (count > bufferSize) {
+                    count = bufferSize;
+                }
+                read(fd, buffer, count);
+                event.write(buffer, count);
+                onChunkData(buffer, count);
+
+                chunkOffset += count;
+            }
+            return sizeof(ChunkHeader) + chunkSize;
+        }
+
+        /**
+         * @brief Generate the trailer so its size is known
+         * 
+         * @param probe true if this is for a dedupe probe, which does not include the chunk count or meta data
+         * @return size_t Number of bytes writeTrailer() will write, including the chunk header
+         * 
+         * This is JSON for protocol version 1, or TrailerV2 and CBOR meta data for version 2. The version 2
+         * trailer is encoded directly into the event by writeTrailer() instead of being buffered.
+         */
+        size_t prepareTrailer(bool probe);
+
+        /**
+         * @brief Write the chunk header and trailer generated by prepareTrailer() to an event
+         * 
+         * @return size_t Number of bytes written to the event
+         */
+        size_t writeTrailer(CloudEvent &event);
+
+        /**
+         * @brief Get the SHA-1 hash of the file as hex
+         */
+        String hashHex() const;
+
+        uint8_t protocolVersion = kProtocolVersion; //!< Protocol version to send
+        UploadQueueEntry *queueEntry = nullptr; //!< Entry for the file being sent
+        int fd = -1; //!< File system file descriptor (from open()) for file being sent
+        size_t fileSize = 0; //!< Size of the file
+        uint8_t digest[20]; //!< SHA-1 hash of file (binary)
+        uint32_t fileId = 0; //!< fileId, used to identify which file when the event is received by the cloud
+        size_t chunkOffset = 0; //!< Offset in file for the chunk being sent
+        size_t chunkIndex = 0; //!< Which chunk will be sent next
+        unsigned long fileStartTime = 0; //!< millis value when the file started being processed
+
+    protected:
+        /**
+         * @brief Write a chunk header to an event
+         */
+        void writeChunkHeader(CloudEvent &event, uint8_t flags, size_t chunkIndex, size_t chunkSize, size_t chunkOffset);
+
+        bool trailerProbe = false; //!< The trailer generated by prepareTrailer() is a probe
+        size_t trailerSize = 0; //!< Size of the trailer generated by prepareTrailer(), not including the chunk header
+        String trailerJson; //!< Protocol version 1 trailer generated by prepareTrailer()
+        TrailerV2 trailerV2; //!< Protocol version 2 trailer generated by prepareTrailer(), followed by the CBOR meta data
+    };
+
+    /**
+     * @brief Hashes queued files a few bytes at a time while offline, saving the result in the queue entry
+     * 
+     * This is shared by FileUploadRK and FileUploaderRK.
+     */
+    class FilePreparer {
+    public:
+        /**
+         * @brief Hash up to maxBytes of the next immutable queue entry that has not been prepared
+         * 
+         * @param owner Object whose lock() and unlock() protect queue
+         * @param queue Upload queue
+         * @param buffer Buffer to read the file with
+         * @param bufferSize Size of buffer in bytes
+         * @param maxBytes Maximum number of bytes to hash during this call
+         */
+        template<class Owner>
+        void loop(Owner &owner, std::deque<UploadQueueEntry *> &queue, uint8_t *buffer, size_t bufferSize, size_t maxBytes) {
+            if (maxBytes == 0) {
+                return;
+            }
+            if (!queueEntry) {
+                WITH_LOCK(owner) {
+                    for(auto it = queue.begin(); it != queue.end(); it++) {
+                        if ((*it)->immutable && !(*it)->prepared) {
+                            queueEntry = *it;
+                            break;
+                        }
+                    }
+                }
+                if (!queueEntry || !start()) {
+                    return;
+                }
+            }
+            hash(buffer, bufferSize, maxBytes);
+        }
+
+        /**
+         * @brief Stop preparing the current entry, if any. Call this before removing entries from the queue.
+         */
+        void abort();
+
+    protected:
+        /**
+         * @brief Open queueEntry and start hashing it
+         * 
+         * @return true if it was opened
+         */
+        bool start();
+
+        /**
+         * @brief Hash up to maxBytes more of queueEntry, and save the hash when the end is reached
+         */
+        void hash(uint8_t *buffer, size_t bufferSize, size_t maxBytes);
+
+        UploadQueueEntry *queueEntry = nullptr; //!< Queue entry being hashed, or nullptr
+        int fd = -1; //!< File descriptor for queueEntry
+        size_t offset = 0; //!< Number of bytes of queueEntry hashed so far
+        SHA1_CTX ctx; //!< SHA-1 context for queueEntry
+    };
+
 protected:
 
     /**
@@ -166,6 +442,31 @@ protected:
      */
     void stateSendChunk();
 
+    /**
+     * @brief State handler. Send the dedupe probe (trailer with kFlagProbe).
+     */
+    void stateSendProbe();
+
+    /**
+     * @brief State handler. Wait for the probe publish to complete, then for the probe response
+     * 
+     * Next state is:
+     * - stateStart if the cloud already has the file
+     * - stateSendChunk if the cloud does not have the file, or no response was received
+     * - stateWaitBeforeRetry if an error occurred
+     */
+    void stateWaitProbeResponse();
+
+    /**
+     * @brief Subscription handler for probe responses
+     */
+    void probeResponseHandler(const char *eventName, const char *data);
+
+    /**
+     * @brief The current file is done; call the completion handler and remove it from the queue
+     */
+    void fileComplete();
+
     /**
      * @brief State handler. Wait for the publish to complete
      * 
@@ -201,23 +502,25 @@ protected:
 
     std::deque<UploadQueueEntry *>uploadQueue; //!< Queue of files to upload (in RAM only)
 
-    int fd = -1; //!< File system file descriptor (from open()) for file being sent
     static const size_t bufferSize = 512; //!< Internal buffer size, used for reading from the file system
     uint8_t buffer[bufferSize]; //!< Buffer using for reading from the file system
-    String hash; //!< SHA-1 hash of file 
-    uint32_t fileId = 0; //!< fileId, used to identify which file when the event is received by the cloud
-    size_t chunkOffset = 0; //!< Offset in file for the chunk being sent
-    size_t chunkIndex = 0; //!< Which chunk will be sent next
+    FileSender sender; //!< File being sent (protocolVersion is set using withProtocolVersion())
     size_t eventOffset = 0; //!< Offset in the event to write to next
-    size_t fileSize = 0; //!< Size of the file
     unsigned long stateTime = 0; //!< millis value when we entered the state (used for stateWaitBeforeRetry)
-    unsigned long fileStartTime = 0; //!< millis value when the file started being processed
     bool trailerSent = false; //!< Whether the trailer has been sent yet
+
+    size_t prepareBytesPerLoop = 4096; //!< Bytes to hash per loop while offline (set using withPrepareBytesPerLoop())
+    FilePreparer preparer; //!< Hashes queued files while offline
     CloudEvent cloudEvent; //!< Event
 
     size_t maxEventSize = 16384; //!< Maximum size of the event to send
+    bool chunkCrc = false; //!< Append a CRC-32C to each chunk (set using withChunkCrc())
     uint32_t nextFileId = 0; //!< Next fileId to send, initialized to random value after cloud connection
 
+    bool dedupe = false; //!< Send a probe before sending the file (set using withDedupe())
+    unsigned long probeTimeoutMs = 30000; //!< How long to wait for a probe response
+    int probeResult = kProbeNoResponse; //!< Set by probeResponseHandler for the current fileId
+
     unsigned long retryWaitMs = 120000;//!< How long to wait in stateWaitBeforeRetry state
 
     std::function<void(const UploadQueueEntry *queueEntry)> completionHandler = 0; //!< Function to call when file has been sent
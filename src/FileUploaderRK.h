@@ -0,0 +1,485 @@
+#ifndef __FILEUPLOADERRK_H
+#define __FILEUPLOADERRK_H
+
+#include "FileUploadRK.h"
+#include "Crc32cRK.h"
+#include "SHA1_RK.h"
+
+#include <fcntl.h>
+
+/**
+ * @brief Base class for FileUploaderRK feature policies
+ *
+ * A feature is passed as a template parameter to FileUploaderRK and overrides (hides) any of these
+ * hooks. The hooks are resolved at compile time, so a feature that is not used adds no code, and
+ * a feature with no state adds no RAM.
+ */
+class FileUploaderFeature {
+public:
+    static const uint8_t chunkFlags = 0; //!< Flags to set in the ChunkHeader of data chunks
+    static const size_t chunkOverhead = 0; //!< Number of bytes the feature writes after the chunk data
+
+    /**
+     * @brief Called before the data for a chunk is written to the event
+     */
+    void onChunkStart() {};
+
+    /**
+     * @brief Called for each block of chunk data written to the event
+     *
+     * @param data Pointer to the data
+     * @param len Length of the data in bytes
+     */
+    void onChunkData(const uint8_t *data, size_t len) {};
+
+    /**
+     * @brief Called after the chunk data has been written. Must write exactly chunkOverhead bytes.
+     *
+     * @param event The event being built
+     */
+    void onChunkEnd(CloudEvent &event) {};
+
+    /**
+     * @brief Called after an event has been published successfully
+     *
+     * @param eventSize Number of bytes in the event
+     */
+    void onPublished(size_t eventSize) {};
+
+    /**
+     * @brief Called when publishing an event fails
+     *
+     * @param err Error code from CloudEvent::error()
+     */
+    void onPublishFailed(int err) {};
+
+    /**
+     * @brief Called after the trailer for a file has been sent
+     *
+     * @param fileSize Size of the file in bytes
+     */
+    void onFileComplete(size_t fileSize) {};
+};
+
+/**
+ * @brief Feature policy: append a CRC-32C to each chunk
+ *
+ * This is the same as FileUploadRK::withChunkCrc().
+ */
+class FileUploaderChunkCrc : public FileUploaderFeature {
+public:
+    static const uint8_t chunkFlags = FileUploadRK::kFlagChunkCrc; //!< Flags to set in the ChunkHeader of data chunks
+    static const size_t chunkOverhead = sizeof(uint32_t); //!< CRC-32C is written after the chunk data
+
+    void onChunkStart() { crc = 0; };
+    void onChunkData(const uint8_t *data, size_t len) { crc = Crc32cRK::update(crc, data, len); };
+    void onChunkEnd(CloudEvent &event) { event.write((const uint8_t *) &crc, sizeof(crc)); };
+
+protected:
+    uint32_t crc = 0; //!< CRC-32C of the chunk data so far
+};
+
+/**
+ * @brief Feature policy: keep upload statistics
+ *
+ * Use uploader.feature<FileUploaderStats>() to access the counters.
+ */
+class FileUploaderStats : public FileUploaderFeature {
+public:
+    void onPublished(size_t eventSize) { eventsSent++; bytesSent += eventSize; };
+    void onPublishFailed(int err) { publishErrors++; };
+    void onFileComplete(size_t fileSize) { filesSent++; fileBytesSent += fileSize; };
+
+    uint32_t filesSent = 0; //!< Number of files that have been completely sent
+    uint32_t eventsSent = 0; //!< Number of events that were published successfully
+    uint32_t publishErrors = 0; //!< Number of events that failed to publish
+    uint64_t bytesSent = 0; //!< Number of event bytes, including headers and trailers
+    uint64_t fileBytesSent = 0; //!< Number of file bytes in completed files
+};
+
+/**
+ * @brief Compile-time configured version of FileUploadRK
+ *
+ * @tparam EventSize Maximum event size in bytes (replaces FileUploadRK::withMaxEventSize())
+ * @tparam ReadBufferSize Size of the buffer used for reading from the file system
+ * @tparam Features Optional feature policies, such as FileUploaderChunkCrc or FileUploaderStats
+ *
+ * This sends the same events as FileUploadRK, so the same logic block can be used to receive them.
+ * Opening and hashing the file, writing chunks, the trailer, and the dedupe probe, and hashing queued
+ * files while offline are done by FileUploadRK::FileSender and FileUploadRK::FilePreparer, which
+ * FileUploadRK also uses. Only the state machine is separate.
+ *
+ * Unlike FileUploadRK this is not a singleton; declare it as a global variable. The sizes are
+ * constants, the state machine uses a member function pointer instead of std::function, and
+ * features that are not listed are not compiled in.
+ *
+ * ```
+ * FileUploaderRK<8192, 1024, FileUploaderChunkCrc> uploader;
+ * ```
+ *
+ * From global application setup you must call uploader.setup() and from loop uploader.loop().
+ */
+template<size_t EventSize = 16384, size_t ReadBufferSize = 512, class... Features>
+class FileUploaderRK : public Features... {
+public:
+    typedef FileUploadRK::ChunkHeader ChunkHeader; //!< Same header as FileUploadRK
+    typedef FileUploadRK::UploadQueueEntry UploadQueueEntry; //!< Same queue entry as FileUploadRK
+    typedef void (*CompletionHandler)(const UploadQueueEntry *queueEntry); //!< Completion handler function
+
+    static constexpr uint8_t kChunkFlags = (uint8_t)(0 | ... | Features::chunkFlags); //!< Flags set in data chunk headers
+    static constexpr size_t kChunkOverhead = (0 + ... + Features::chunkOverhead); //!< Bytes written after chunk data
+    static constexpr size_t kMaxChunkSize = EventSize - sizeof(ChunkHeader) - kChunkOverhead; //!< Maximum chunk data bytes per event
+
+    static_assert(EventSize <= 16384, "EventSize cannot be larger than 16384");
+    static_assert(EventSize > sizeof(ChunkHeader) + kChunkOverhead, "EventSize is too small");
+    static_assert(ReadBufferSize > 0, "ReadBufferSize must be non-zero");
+
+    /**
+     * @brief Set the event name to use for uploads (default: fileUpload)
+     *
+     * @param eventName
+     * @return FileUploaderRK&
+     */
+    FileUploaderRK &withEventName(const char *eventName) { this->eventName = eventName; return *this; };
+
+    /**
+     * @brief Protocol version to send (default: FileUploadRK::kProtocolVersion, 2)
+     *
+     * @param protocolVersion 2 for a binary trailer with CBOR meta data, or 1 for a JSON trailer
+     * @return FileUploaderRK&
+     *
+     * This is the same as FileUploadRK::withProtocolVersion().
+     */
+    FileUploaderRK &withProtocolVersion(uint8_t protocolVersion) { sender.protocolVersion = protocolVersion; return *this; };
+
+    /**
+     * @brief Ask the cloud if it already has the file before sending it (default: false)
+     *
+     * @param enable
+     * @return FileUploaderRK&
+     *
+     * This is the same as FileUploadRK::withDedupe(). This must be set before calling setup()!
+     */
+    FileUploaderRK &withDedupe(bool enable = true) { this->dedupe = enable; return *this; };
+
+    /**
+     * @brief How long to wait for a response to a dedupe probe, in milliseconds (default: 30000)
+     *
+     * @param probeTimeoutMs
+     * @return FileUploaderRK&
+     */
+    FileUploaderRK &withProbeTimeoutMs(unsigned long probeTimeoutMs) { this->probeTimeoutMs = probeTimeoutMs; return *this; };
+
+    /**
+     * @brief Set how many bytes of queued files to hash per call to loop() while offline (default: 4096)
+     *
+     * @param prepareBytesPerLoop Number of bytes, or 0 to disable hashing while offline
+     * @return FileUploaderRK&
+     *
+     * This is the same as FileUploadRK::withPrepareBytesPerLoop().
+     */
+    FileUploaderRK &withPrepareBytesPerLoop(size_t prepareBytesPerLoop) { this->prepareBytesPerLoop = prepareBytesPerLoop; return *this; };
+
+    /**
+     * @brief Set the function to call when a file has been successfully sent
+     *
+     * @param fn
+     * @return FileUploaderRK&
+     */
+    FileUploaderRK &withCompletionHandler(CompletionHandler fn) { this->completionHandler = fn; return *this; };
+
+    /**
+     * @brief Access a feature policy, for example feature<FileUploaderStats>().filesSent
+     */
+    template<class Feature>
+    Feature &feature() { return *this; };
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     */
+    bool setup() {
+        os_mutex_create(&mutex);
+
+        if (dedupe) {
+            String probeEventName = eventName + "Probe/" + System.deviceID();
+            Particle.subscribe(probeEventName, &FileUploaderRK::probeResponseHandler, this);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     */
+    void loop() {
+        (this->*stateHandler)();
+    }
+
+    /**
+     * @brief Enqueue a file to upload
+     *
+     * @param path
+     * @param meta
+     * @param immutable Same as FileUploadRK::queueFileToUpload()
+     * @return int
+     */
+    int queueFileToUpload(const char *path, Variant meta = {}, bool immutable = false) {
+        UploadQueueEntry *uploadQueueEntry = new UploadQueueEntry();
+        if (!uploadQueueEntry) {
+            return SYSTEM_ERROR_NO_MEMORY;
+        }
+        uploadQueueEntry->path = path;
+        uploadQueueEntry->meta = meta;
+        uploadQueueEntry->immutable = immutable;
+
+        WITH_LOCK(*this) {
+            uploadQueue.push_back(uploadQueueEntry);
+        }
+        return SYSTEM_ERROR_NONE;
+    }
+
+    /**
+     * @brief Locks the mutex that protects shared resources
+     */
+    void lock() { os_mutex_lock(mutex); };
+
+    /**
+     * @brief Attempts to lock the mutex that protects shared resources
+     */
+    bool tryLock() { return os_mutex_trylock(mutex); };
+
+    /**
+     * @brief Unlocks the mutex that protects shared resources
+     */
+    void unlock() { os_mutex_unlock(mutex); };
+
+    static const unsigned long kRetryWaitMs = 120000; //!< How long to wait in stateWaitBeforeRetry state
+
+protected:
+    typedef void (FileUploaderRK::*StateHandler)(); //!< State handler member function
+
+    /**
+     * @brief Call a feature hook on all features (compile-time dispatch)
+     */
+    void onChunkStart() { (static_cast<Features&>(*this).onChunkStart(), ...); };
+    void onChunkData(const uint8_t *data, size_t len) { (static_cast<Features&>(*this).onChunkData(data, len), ...); };
+    void onChunkEnd() { (static_cast<Features&>(*this).onChunkEnd(cloudEvent), ...); };
+    void onPublished(size_t eventSize) { (static_cast<Features&>(*this).onPublished(eventSize), ...); };
+    void onPublishFailed(int err) { (static_cast<Features&>(*this).onPublishFailed(err), ...); };
+    void onFileComplete(size_t fileSize) { (static_cast<Features&>(*this).onFileComplete(fileSize), ...); };
+
+    /**
+     * @brief State handler. Same as FileUploadRK::stateStart().
+     */
+    void stateStart() {
+        if (!Particle.connected()) {
+            preparer.loop(*this, uploadQueue, buffer, ReadBufferSize, prepareBytesPerLoop);
+            return;
+        }
+        preparer.abort();
+
+        if (nextFileId == 0) {
+            nextFileId = (uint32_t) random();
+        }
+
+        WITH_LOCK(*this) {
+            if (uploadQueue.size() == 0) {
+                return;
+            }
+
+            UploadQueueEntry *queueEntry = uploadQueue.front();
+            if (sender.start(queueEntry, nextFileId, buffer, ReadBufferSize) != SYSTEM_ERROR_NONE) {
+                uploadQueue.pop_front();
+                delete queueEntry;
+                return;
+            }
+            nextFileId++;
+            trailerSent = false;
+
+            stateHandler = dedupe ? &FileUploaderRK::stateSendProbe : &FileUploaderRK::stateSendChunk;
+        }
+    }
+
+    /**
+     * @brief State handler. Send a chunk of data, or the trailer.
+     */
+    void stateSendChunk() {
+        if (!CloudEvent::canPublish(EventSize)) {
+            return;
+        }
+
+        cloudEvent.clear();
+        cloudEvent.name(eventName);
+        cloudEvent.contentType(ContentType::BINARY);
+
+        size_t eventOffset = 0;
+
+        if (!sender.allChunksWritten()) {
+            onChunkStart();
+            eventOffset += sender.writeChunk(cloudEvent, kMaxChunkSize, kChunkFlags, buffer, ReadBufferSize, [this](const uint8_t *data, size_t len) {
+                onChunkData(data, len);
+            });
+            onChunkEnd();
+            eventOffset += kChunkOverhead;
+        }
+
+        if (sender.allChunksWritten()) {
+            size_t trailerSize = sender.prepareTrailer(false);
+            if ((eventOffset + trailerSize) <= EventSize) {
+                eventOffset += sender.writeTrailer(cloudEvent);
+                trailerSent = true;
+            }
+        }
+
+        lastEventSize = eventOffset;
+        Particle.publish(cloudEvent);
+
+        stateHandler = &FileUploaderRK::stateWaitPublishComplete;
+    }
+
+    /**
+     * @brief State handler. Wait for the publish to complete
+     */
+    void stateWaitPublishComplete() {
+        if (cloudEvent.isSending()) {
+            return;
+        }
+
+        int err = cloudEvent.error();
+        if (err) {
+            onPublishFailed(err);
+            sender.end();
+
+            stateTime = millis();
+            stateHandler = &FileUploaderRK::stateWaitBeforeRetry;
+            return;
+        }
+        onPublished(lastEventSize);
+
+        if (!trailerSent) {
+            stateHandler = &FileUploaderRK::stateSendChunk;
+        } else {
+            onFileComplete(sender.fileSize);
+            fileComplete();
+        }
+    }
+
+    /**
+     * @brief State handler. Same as FileUploadRK::stateSendProbe().
+     */
+    void stateSendProbe() {
+        lastEventSize = sender.prepareTrailer(true);
+        if (!CloudEvent::canPublish(lastEventSize)) {
+            return;
+        }
+
+        cloudEvent.clear();
+        cloudEvent.name(eventName);
+        cloudEvent.contentType(ContentType::BINARY);
+        sender.writeTrailer(cloudEvent);
+
+        WITH_LOCK(*this) {
+            probeResult = FileUploadRK::kProbeNoResponse;
+        }
+        Particle.publish(cloudEvent);
+
+        stateTime = millis();
+        stateHandler = &FileUploaderRK::stateWaitProbeResponse;
+    }
+
+    /**
+     * @brief State handler. Same as FileUploadRK::stateWaitProbeResponse().
+     */
+    void stateWaitProbeResponse() {
+        if (cloudEvent.isSending()) {
+            return;
+        }
+
+        int err = cloudEvent.error();
+        if (err) {
+            onPublishFailed(err);
+            sender.end();
+
+            stateTime = millis();
+            stateHandler = &FileUploaderRK::stateWaitBeforeRetry;
+            return;
+        }
+
+        int result;
+        WITH_LOCK(*this) {
+            result = probeResult;
+        }
+
+        if (result == FileUploadRK::kProbeStored) {
+            fileComplete();
+        }
+        else
+        if (result == FileUploadRK::kProbeNotStored || millis() - stateTime >= probeTimeoutMs) {
+            stateHandler = &FileUploaderRK::stateSendChunk;
+        }
+    }
+
+    /**
+     * @brief Subscription handler for probe responses
+     */
+    void probeResponseHandler(const char *eventName, const char *data) {
+        WITH_LOCK(*this) {
+            int result = FileUploadRK::parseProbeResponse(data, sender.fileId);
+            if (result != FileUploadRK::kProbeNoResponse) {
+                probeResult = result;
+            }
+        }
+    }
+
+    /**
+     * @brief The current file is done; call the completion handler and remove it from the queue
+     */
+    void fileComplete() {
+        sender.end();
+
+        UploadQueueEntry *queueEntry;
+        WITH_LOCK(*this) {
+            queueEntry = uploadQueue.front();
+            uploadQueue.pop_front();
+        }
+        if (completionHandler) {
+            completionHandler(queueEntry);
+        }
+        delete queueEntry;
+
+        stateHandler = &FileUploaderRK::stateStart;
+    }
+
+    /**
+     * @brief State handler. Wait for kRetryWaitMs before going back to stateStart
+     */
+    void stateWaitBeforeRetry() {
+        if (millis() - stateTime < kRetryWaitMs) {
+            preparer.loop(*this, uploadQueue, buffer, ReadBufferSize, prepareBytesPerLoop);
+            return;
+        }
+        stateHandler = &FileUploaderRK::stateStart;
+    }
+
+    os_mutex_t mutex = 0; //!< Mutex to protect shared resources, initialized in setup()
+    String eventName = "fileUpload"; //!< Event name to use for uploads
+    StateHandler stateHandler = &FileUploaderRK::stateStart; //!< State handler, called from loop()
+    std::deque<UploadQueueEntry *>uploadQueue; //!< Queue of files to upload (in RAM only)
+    CompletionHandler completionHandler = 0; //!< Function to call when file has been sent
+
+    uint8_t buffer[ReadBufferSize]; //!< Buffer using for reading from the file system
+    FileUploadRK::FileSender sender; //!< File being sent
+    FileUploadRK::FilePreparer preparer; //!< Hashes queued files while offline
+    size_t prepareBytesPerLoop = 4096; //!< Bytes to hash per loop while offline
+    uint32_t nextFileId = 0; //!< Next fileId to send, initialized to random value after cloud connection
+    size_t lastEventSize = 0; //!< Size of the event being published
+    unsigned long stateTime = 0; //!< millis value when we entered the state (used for stateWaitBeforeRetry)
+    bool trailerSent = false; //!< Whether the trailer has been sent yet
+
+    bool dedupe = false; //!< Send a probe before sending the file (set using withDedupe())
+    unsigned long probeTimeoutMs = 30000; //!< How long to wait for a probe response
+    int probeResult = FileUploadRK::kProbeNoResponse; //!< Set by probeResponseHandler for the current fileId
+
+    CloudEvent cloudEvent; //!< Event
+};
+
+#endif // __FILEUPLOADERRK_H
@@ -1,3 +1,5 @@
+#include "FileDownloadRK.h"
+#include "FileUploadBench.h"
 #include "FileUploadRK.h"
 #include "SequentialFileRK.h"
 
@@ -16,6 +18,7 @@ SerialLogHandler logHandler(LOG_LEVEL_TRACE);
 const std::chrono::milliseconds publishPeriod = 5min;
 unsigned long lastPublish = 0;
 CloudEvent event;
+size_t benchEventSize = 0; // Set by benchHandler, benchmarks are run from loop
 
 // Random test data
 
@@ -274,12 +277,15 @@ void publishData1();
 void publishData2();
 void publishDataRandom(int numBytes);
 void completionHandler(const FileUploadRK::UploadQueueEntry *queueEntry);
+void downloadCompletionHandler(const char *path, const Variant &meta);
 
 int testHandler(String cmd);
+int benchHandler(String cmd);
 
 
 void setup() {
     Particle.function("test", testHandler);
+    Particle.function("bench", benchHandler);
 
     // Remove any existing temporary files
     testFiles
@@ -291,6 +297,12 @@ void setup() {
     FileUploadRK::instance()
         .withCompletionHandler(completionHandler)
         .withEventName("fileUpload")
+        .withChunkCrc()
+        .setup();
+
+    // Set up the downloader. Files are saved in /usr/downloads.
+    FileDownloadRK::instance()
+        .withCompletionHandler(downloadCompletionHandler)
         .setup();
 
 }
@@ -299,6 +311,17 @@ void setup() {
 void loop() {
     // This must be called for the uploaded to be used
     FileUploadRK::instance().loop();
+    FileDownloadRK::instance().loop();
+
+    if (benchEventSize) {
+        String results = FileUploadBench::run(benchEventSize);
+        benchEventSize = 0;
+
+        Log.info("bench %s", results.c_str());
+        if (Particle.connected()) {
+            Particle.publish("fileUploadBench", results.c_str());
+        }
+    }
 
 
     // If you wanted to test continuously, you could update this code:
@@ -321,7 +344,7 @@ void publishData1() {
         close(fd);
     }
 
-    FileUploadRK::instance().queueFileToUpload(testPath);
+    FileUploadRK::instance().queueFileToUpload(testPath, {}, true);
 }
 
 void publishData2() {
@@ -333,7 +356,7 @@ void publishData2() {
         close(fd);
     }
 
-    FileUploadRK::instance().queueFileToUpload(testPath);
+    FileUploadRK::instance().queueFileToUpload(testPath, {}, true);
 }
 
 void publishDataRandom(int numBytes) {
@@ -363,7 +386,7 @@ void publishDataRandom(int numBytes) {
     meta.set("numBytes", numBytes);
     meta.set("path", testPath.c_str());
 
-    FileUploadRK::instance().queueFileToUpload(testPath, meta);
+    FileUploadRK::instance().queueFileToUpload(testPath, meta, true);
 
 }
 
@@ -373,6 +396,14 @@ void completionHandler(const FileUploadRK::UploadQueueEntry *queueEntry) {
     unlink(queueEntry->path.c_str());
 }
 
+void downloadCompletionHandler(const char *path, const Variant &meta) {
+    struct stat sb;
+    sb.st_size = 0;
+    stat(path, &sb);
+
+    Log.info("file received %s size=%d meta=%s", path, (int)sb.st_size, meta.toJSON().c_str());
+}
+
 
 int testHandler(String cmd) {
     int n = cmd.toInt();
@@ -394,3 +425,14 @@ int testHandler(String cmd) {
 
     return 0;
 }
+
+int benchHandler(String cmd) {
+    // Optional argument is the event size to use for the event assembly test
+    int eventSize = cmd.toInt();
+    if (eventSize <= (int)sizeof(FileUploadRK::ChunkHeader) + 4 || eventSize > 16384) {
+        eventSize = 16384;
+    }
+    benchEventSize = (size_t) eventSize;
+
+    return 0;
+}